@@ -0,0 +1,410 @@
+/*
+ * xmpp-share-server
+ * Copyright (C) 2010-2013 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdlib>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QSettings>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QTimer>
+#include <QUrl>
+
+#include "QDjangoHttpRequest.h"
+#include "QDjangoHttpServer.h"
+#include "QDjangoUrlResolver.h"
+
+#include "QXmppPasswordChecker.h"
+#include "QXmppServer.h"
+
+#include "auth_bench.h"
+#include "mod_auth.h"
+
+// interval between batches of logins, in milliseconds
+static const int tickInterval = 10;
+
+// maximum time to wait for outstanding logins, in milliseconds
+static const int drainTimeout = 30000;
+
+BenchLogger::BenchLogger(QObject *parent)
+    : QXmppLogger(parent)
+{
+    setLoggingType(QXmppLogger::NoLogging);
+}
+
+qint64 BenchLogger::counter(const QString &name) const
+{
+    return m_counters.value(name);
+}
+
+void BenchLogger::setGauge(const QString &gauge, double value)
+{
+    Q_UNUSED(gauge);
+    Q_UNUSED(value);
+}
+
+void BenchLogger::updateCounter(const QString &counter, qint64 amount)
+{
+    m_counters[counter] += amount;
+}
+
+DelayedResponse::DelayedResponse(int delay)
+    : m_isReady(false)
+{
+    setHeader("Content-Type", "text/plain");
+    QTimer::singleShot(delay, this, SLOT(onTimeout()));
+}
+
+bool DelayedResponse::isReady() const
+{
+    return m_isReady;
+}
+
+void DelayedResponse::onTimeout()
+{
+    m_isReady = true;
+    emit ready();
+}
+
+HttpStandIn::HttpStandIn(const QHash<QString, QString> &passwords, int latency, QObject *parent)
+    : QObject(parent)
+    , m_latency(latency)
+    , m_passwords(passwords)
+    , m_requestCount(0)
+{
+    m_server = new QDjangoHttpServer(this);
+    m_server->urls()->set(QRegExp("^auth/$"), this, "respondToRequest");
+}
+
+bool HttpStandIn::listen(quint16 port)
+{
+    return m_server->listen(QHostAddress::LocalHost, port);
+}
+
+int HttpStandIn::requestCount() const
+{
+    return m_requestCount;
+}
+
+QDjangoHttpResponse *HttpStandIn::respondToRequest(const QDjangoHttpRequest &request)
+{
+    m_requestCount++;
+
+    QUrl url;
+    url.setEncodedQuery(request.body());
+    const QString username = url.queryItemValue("username");
+    const QString domain = url.queryItemValue("domain");
+
+    DelayedResponse *response = new DelayedResponse(m_latency);
+    if (!m_passwords.contains(username)) {
+        response->setStatusCode(QDjangoHttpResponse::NotFound);
+    } else if (url.hasQueryItem("password")) {
+        if (url.queryItemValue("password") != m_passwords.value(username))
+            response->setStatusCode(QDjangoHttpResponse::NotFound);
+    } else {
+        const QByteArray input = QString("%1:%2:%3").arg(username, domain, m_passwords.value(username)).toUtf8();
+        response->setBody(QCryptographicHash::hash(input, QCryptographicHash::Md5).toHex());
+    }
+    return response;
+}
+
+LoginStorm::LoginStorm(XmppPasswordChecker *checker, const QString &domain, int users, QObject *parent)
+    : QObject(parent)
+    , m_checker(checker)
+    , m_domain(domain)
+    , m_users(users)
+    , m_mode(PasswordMode)
+    , m_rate(0)
+    , m_remaining(0)
+    , m_credit(0)
+    , m_pending(0)
+    , m_completed(0)
+    , m_failed(0)
+    , m_elapsed(0)
+{
+    bool check;
+    Q_UNUSED(check);
+
+    m_timer = new QTimer(this);
+    m_timer->setInterval(tickInterval);
+    check = connect(m_timer, SIGNAL(timeout()),
+                    this, SLOT(onTick()));
+    Q_ASSERT(check);
+}
+
+/** Starts issuing \a rate logins per second for \a duration seconds.
+ */
+void LoginStorm::start(int rate, int duration, Mode mode)
+{
+    m_mode = mode;
+    m_rate = rate;
+    m_remaining = rate * duration;
+    m_latencies.reserve(m_remaining);
+    m_clock.start();
+    m_timer->start();
+}
+
+int LoginStorm::completed() const
+{
+    return m_completed;
+}
+
+int LoginStorm::failed() const
+{
+    return m_failed;
+}
+
+/** Returns the time in milliseconds from the first login to the last
+ *  completed one.
+ */
+qint64 LoginStorm::elapsed() const
+{
+    return m_elapsed;
+}
+
+/** Returns the latency of each completed login, in nanoseconds.
+ */
+QVector<qint64> LoginStorm::latencies() const
+{
+    return m_latencies;
+}
+
+void LoginStorm::onReply()
+{
+    QXmppPasswordReply *reply = qobject_cast<QXmppPasswordReply*>(sender());
+    if (!reply)
+        return;
+
+    m_latencies << m_clock.nsecsElapsed() - reply->property("__bench_start").toLongLong();
+    if (reply->error() == QXmppPasswordReply::NoError)
+        m_completed++;
+    else
+        m_failed++;
+    reply->deleteLater();
+
+    if (--m_pending == 0 && m_remaining == 0) {
+        m_elapsed = m_clock.elapsed();
+        emit finished();
+    }
+}
+
+void LoginStorm::onTick()
+{
+    bool check;
+    Q_UNUSED(check);
+
+    // keep the requested rate even if ticks are late
+    m_credit += m_rate * tickInterval / 1000.0;
+    while (m_credit >= 1.0 && m_remaining > 0) {
+        m_credit -= 1.0;
+        m_remaining--;
+
+        const int index = qrand() % m_users;
+        QXmppPasswordRequest request;
+        request.setDomain(m_domain);
+        request.setUsername(QString("user%1").arg(index));
+
+        QXmppPasswordReply *reply;
+        const bool digest = m_mode == DigestMode || (m_mode == MixedMode && (m_remaining % 2));
+        if (digest) {
+            reply = m_checker->getDigest(request);
+        } else {
+            request.setPassword(QString("password%1").arg(index));
+            reply = m_checker->checkPassword(request);
+        }
+        reply->setProperty("__bench_start", m_clock.nsecsElapsed());
+        check = connect(reply, SIGNAL(finished()),
+                        this, SLOT(onReply()));
+        Q_ASSERT(check);
+        m_pending++;
+    }
+
+    if (!m_remaining) {
+        m_timer->stop();
+        if (!m_pending) {
+            m_elapsed = m_clock.elapsed();
+            emit finished();
+        }
+    }
+}
+
+static qint64 percentile(const QVector<qint64> &sorted, double p)
+{
+    if (sorted.isEmpty())
+        return 0;
+    const int index = qMin(sorted.size() - 1, int(sorted.size() * p));
+    return sorted.at(index);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName("auth-bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Login storm benchmark for the authentication extension.");
+    parser.addHelpOption();
+    QCommandLineOption backendOption("backend", "Backend to use: file, sql or http.", "backend", "file");
+    QCommandLineOption modeOption("mode", "Lookups to perform: password, digest or mixed.", "mode", "mixed");
+    QCommandLineOption rateOption("rate", "Logins per second.", "rate", "1000");
+    QCommandLineOption durationOption("duration", "Duration of the storm in seconds.", "seconds", "10");
+    QCommandLineOption usersOption("users", "Number of distinct accounts.", "users", "10000");
+    QCommandLineOption latencyOption("latency", "Latency of the HTTP stand-in in milliseconds.", "msecs", "20");
+    QCommandLineOption portOption("port", "Port of the HTTP stand-in.", "port", "18080");
+    QCommandLineOption cacheSizeOption("cache-size", "Size of the credentials cache.", "entries", "10000");
+    QCommandLineOption seedOption("seed", "Seed for the choice of accounts.", "seed", "1");
+    parser.addOption(backendOption);
+    parser.addOption(modeOption);
+    parser.addOption(rateOption);
+    parser.addOption(durationOption);
+    parser.addOption(usersOption);
+    parser.addOption(latencyOption);
+    parser.addOption(portOption);
+    parser.addOption(cacheSizeOption);
+    parser.addOption(seedOption);
+    parser.process(app);
+
+    QTextStream out(stdout);
+    const QString domain("localhost");
+    const QString backend = parser.value(backendOption);
+    const int users = qMax(1, parser.value(usersOption).toInt());
+    const uint seed = parser.value(seedOption).toUInt();
+
+    // the same seed picks the same accounts, so that runs can be compared
+    qsrand(seed);
+
+    LoginStorm::Mode mode;
+    if (parser.value(modeOption) == "password") {
+        mode = LoginStorm::PasswordMode;
+    } else if (parser.value(modeOption) == "digest") {
+        mode = LoginStorm::DigestMode;
+    } else if (parser.value(modeOption) == "mixed") {
+        mode = LoginStorm::MixedMode;
+    } else {
+        qWarning("Unsupported mode %s", qPrintable(parser.value(modeOption)));
+        return EXIT_FAILURE;
+    }
+
+    QHash<QString, QString> passwords;
+    for (int i = 0; i < users; ++i)
+        passwords.insert(QString("user%1").arg(i), QString("password%1").arg(i));
+
+    // set up the backend
+    QTemporaryDir dir;
+    HttpStandIn *standIn = 0;
+    QString url;
+    if (backend == "file") {
+        const QString path = dir.path() + "/passwd.ini";
+        QSettings settings(path, QSettings::IniFormat);
+        foreach (const QString &username, passwords.keys())
+            settings.setValue(domain + "/" + username, passwords.value(username));
+        settings.sync();
+        url = QUrl::fromLocalFile(path).toString();
+    } else if (backend == "sql") {
+        const QString path = dir.path() + "/passwd.db";
+        {
+            QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "_bench_connection");
+            db.setDatabaseName(path);
+            if (!db.open()) {
+                qWarning("Could not create SQLite database");
+                return EXIT_FAILURE;
+            }
+            QSqlQuery query(db);
+            query.exec("CREATE TABLE users (jid VARCHAR(255) PRIMARY KEY, password VARCHAR(255))");
+            QVariantList jids, values;
+            foreach (const QString &username, passwords.keys()) {
+                jids << username + "@" + domain;
+                values << passwords.value(username);
+            }
+            db.transaction();
+            query.prepare("INSERT INTO users (jid, password) VALUES (?, ?)");
+            query.addBindValue(jids);
+            query.addBindValue(values);
+            query.execBatch();
+            db.commit();
+            db.close();
+        }
+        QSqlDatabase::removeDatabase("_bench_connection");
+        url = "sqlite://" + path + "?table=users&jid_field=jid&password_field=password";
+    } else if (backend == "http") {
+        const quint16 port = parser.value(portOption).toUShort();
+        standIn = new HttpStandIn(passwords, parser.value(latencyOption).toInt(), &app);
+        if (!standIn->listen(port)) {
+            qWarning("Could not listen on port %i", port);
+            return EXIT_FAILURE;
+        }
+        url = QString("http://127.0.0.1:%1/auth/").arg(port);
+    } else {
+        qWarning("Unsupported backend %s", qPrintable(backend));
+        return EXIT_FAILURE;
+    }
+
+    // set up the password checker
+    BenchLogger logger;
+    QXmppServer server;
+    server.setDomain(domain);
+    server.setLogger(&logger);
+
+    XmppPasswordChecker *checker = new XmppPasswordChecker;
+    server.addExtension(checker);
+    checker->setUrl(url);
+    checker->setCacheSize(parser.value(cacheSizeOption).toInt());
+    if (!checker->start()) {
+        qWarning("Could not start password checker");
+        return EXIT_FAILURE;
+    }
+
+    // run the storm
+    LoginStorm storm(checker, domain, users);
+    QObject::connect(&storm, SIGNAL(finished()), &app, SLOT(quit()));
+    QTimer::singleShot(parser.value(durationOption).toInt() * 1000 + drainTimeout, &app, SLOT(quit()));
+    storm.start(parser.value(rateOption).toInt(), parser.value(durationOption).toInt(), mode);
+    app.exec();
+    checker->stop();
+
+    // report
+    QVector<qint64> latencies = storm.latencies();
+    qSort(latencies);
+    const qint64 hits = logger.counter("auth.cache.hit");
+    const qint64 misses = logger.counter("auth.cache.miss");
+    const qint64 elapsed = qMax(qint64(1), storm.elapsed());
+
+    out << "backend:            " << backend << endl;
+    out << "seed:               " << seed << endl;
+    out << "logins:             " << latencies.size() << " (" << storm.failed() << " failed)" << endl;
+    out << "throughput:         " << (latencies.size() * 1000.0 / elapsed) << " logins/s" << endl;
+    out << "latency p50:        " << percentile(latencies, 0.50) / 1000 << " us" << endl;
+    out << "latency p99:        " << percentile(latencies, 0.99) / 1000 << " us" << endl;
+    out << "latency p99.9:      " << percentile(latencies, 0.999) / 1000 << " us" << endl;
+    out << "latency max:        " << (latencies.isEmpty() ? 0 : latencies.last() / 1000) << " us" << endl;
+    out << "cache hit ratio:    " << (hits + misses ? double(hits) / (hits + misses) : 0.0) << endl;
+    // the file backend has no requests of its own, its lookups are the
+    // cache misses
+    if (standIn) {
+        out << "backend requests:   " << standIn->requestCount() << endl;
+        out << "coalesced lookups:  " << logger.counter("auth.http.coalesced") << endl;
+    } else if (backend == "sql") {
+        out << "backend requests:   " << logger.counter("auth.sql.dispatched") << endl;
+    }
+    return storm.completed() + storm.failed() == latencies.size() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,142 @@
+/*
+ * xmpp-share-server
+ * Copyright (C) 2010-2013 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XMPP_SERVER_AUTH_BENCH_H
+#define XMPP_SERVER_AUTH_BENCH_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QVector>
+
+#include "QDjangoHttpResponse.h"
+
+#include "QXmppLogger.h"
+
+class QDjangoHttpRequest;
+class QDjangoHttpServer;
+class QTimer;
+class QXmppPasswordReply;
+class XmppPasswordChecker;
+
+/** A logger which keeps the counters reported by the extensions.
+ */
+class BenchLogger : public QXmppLogger
+{
+    Q_OBJECT
+
+public:
+    BenchLogger(QObject *parent = 0);
+    qint64 counter(const QString &name) const;
+
+public slots:
+    virtual void setGauge(const QString &gauge, double value);
+    virtual void updateCounter(const QString &counter, qint64 amount);
+
+private:
+    QHash<QString, qint64> m_counters;
+};
+
+/** A response which only becomes ready after a given delay.
+ */
+class DelayedResponse : public QDjangoHttpResponse
+{
+    Q_OBJECT
+
+public:
+    DelayedResponse(int delay);
+    bool isReady() const;
+
+private slots:
+    void onTimeout();
+
+private:
+    bool m_isReady;
+};
+
+/** A local HTTP server which answers like the HTTP auth backend, with
+ *  a configurable latency.
+ */
+class HttpStandIn : public QObject
+{
+    Q_OBJECT
+
+public:
+    HttpStandIn(const QHash<QString, QString> &passwords, int latency, QObject *parent = 0);
+
+    bool listen(quint16 port);
+    int requestCount() const;
+
+private slots:
+    QDjangoHttpResponse *respondToRequest(const QDjangoHttpRequest &request);
+
+private:
+    int m_latency;
+    QHash<QString, QString> m_passwords;
+    int m_requestCount;
+    QDjangoHttpServer *m_server;
+};
+
+/** Drives the password checker at a fixed rate of logins per second.
+ */
+class LoginStorm : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Mode {
+        PasswordMode,
+        DigestMode,
+        MixedMode,
+    };
+
+    LoginStorm(XmppPasswordChecker *checker, const QString &domain, int users, QObject *parent = 0);
+
+    void start(int rate, int duration, Mode mode);
+
+    int completed() const;
+    int failed() const;
+    qint64 elapsed() const;
+    QVector<qint64> latencies() const;
+
+signals:
+    void finished();
+
+private slots:
+    void onReply();
+    void onTick();
+
+private:
+    XmppPasswordChecker *m_checker;
+    QString m_domain;
+    int m_users;
+
+    Mode m_mode;
+    int m_rate;
+    int m_remaining;
+    double m_credit;
+    int m_pending;
+    int m_completed;
+    int m_failed;
+    qint64 m_elapsed;
+    QVector<qint64> m_latencies;
+    QElapsedTimer m_clock;
+    QTimer *m_timer;
+};
+
+#endif
@@ -28,14 +28,18 @@ static const char * ns_http_bind = "http://jabber.org/protocol/httpbind";
 
 QXmppIncomingBosh::QXmppIncomingBosh(const QString &domain, QObject *parent)
     : QXmppIncomingClient(0, domain, parent),
+    m_hold(1),
     m_pendingStart(false),
     m_pendingStop(false),
+    m_requests(2),
     m_signalsEmitted(false),
     m_wait(55)
 {
     m_isConnected = true;
     m_id = QXmppUtils::generateStanzaHash();
-    setInactivityTimeout(m_wait + 10);
+
+    // inactivity is tracked by the connection manager
+    setInactivityTimeout(0);
 }
 
 void QXmppIncomingBosh::disconnectFromHost()
@@ -64,6 +68,21 @@ void QXmppIncomingBosh::handleStream(const QDomElement &stream)
     QXmppIncomingClient::handleStream(stream);
 }
 
+int QXmppIncomingBosh::hold() const
+{
+    return m_hold;
+}
+
+void QXmppIncomingBosh::setHold(int hold)
+{
+    m_hold = hold;
+}
+
+int QXmppIncomingBosh::inactivity() const
+{
+    return m_wait + 10;
+}
+
 bool QXmppIncomingBosh::hasPendingData() const
 {
     return m_pendingStart || m_pendingStop || !m_buffer.isEmpty();
@@ -86,11 +105,14 @@ QByteArray QXmppIncomingBosh::readPendingData()
         data = QString("<body xmlns=\"%1\" type=\"terminate\">").arg(ns_http_bind).toUtf8();
         m_pendingStop = false;
     } else if (m_pendingStart) {
-        data = QString("<body xmlns=\"%1\" xmlns:stream=\"%2\" sid=\"%3\" wait=\"%4\">").arg(
+        data = QString("<body xmlns=\"%1\" xmlns:stream=\"%2\" sid=\"%3\" wait=\"%4\" hold=\"%5\" requests=\"%6\" inactivity=\"%7\">").arg(
             ns_http_bind,
             ns_client,
             m_id,
-            QString::number(m_wait)).toUtf8();
+            QString::number(m_wait),
+            QString::number(m_hold),
+            QString::number(m_requests),
+            QString::number(inactivity())).toUtf8();
         m_pendingStart = false;
     } else {
         data = QString("<body xmlns=\"%1\">").arg(ns_http_bind).toUtf8();
@@ -102,6 +124,16 @@ QByteArray QXmppIncomingBosh::readPendingData()
     return data;
 }
 
+int QXmppIncomingBosh::requests() const
+{
+    return m_requests;
+}
+
+void QXmppIncomingBosh::setRequests(int requests)
+{
+    m_requests = requests;
+}
+
 bool QXmppIncomingBosh::sendData(const QByteArray &data)
 {
     if (!m_isConnected)
@@ -32,6 +32,15 @@ public:
     bool hasPendingData() const;
     QString id() const;
     QByteArray readPendingData();
+
+    int hold() const;
+    void setHold(int hold);
+
+    int inactivity() const;
+
+    int requests() const;
+    void setRequests(int requests);
+
     int wait() const;
 
     /// \cond
@@ -52,10 +61,12 @@ private slots:
 
 private:
     QByteArray m_buffer;
+    int m_hold;
     QString m_id;
     bool m_isConnected;
     bool m_pendingStart;
     bool m_pendingStop;
+    int m_requests;
     bool m_signalsEmitted;
     int m_wait;
 };
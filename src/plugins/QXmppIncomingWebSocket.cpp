@@ -0,0 +1,350 @@
+/*
+ * xmpp-share-server
+ * Copyright (C) 2010-2013 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QCryptographicHash>
+#include <QDomDocument>
+#include <QRegExp>
+#include <QStringList>
+#include <QTcpSocket>
+#include <QtEndian>
+
+#include "QXmppConstants.h"
+#include "QXmppIncomingWebSocket.h"
+#include "QXmppUtils.h"
+
+static const char *ns_framing = "urn:ietf:params:xml:ns:xmpp-framing";
+static const char *ns_stream = "http://etherx.jabber.org/streams";
+static const char *websocketGuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// maximum size of the handshake and of a single message
+static const int maxHandshakeSize = 8192;
+static const int maxMessageSize = 1048576;
+
+// maximum payload size of a control frame
+static const int maxControlSize = 125;
+
+enum Opcode {
+    ContinuationFrame = 0x0,
+    TextFrame = 0x1,
+    BinaryFrame = 0x2,
+    CloseFrame = 0x8,
+    PingFrame = 0x9,
+    PongFrame = 0xa,
+};
+
+enum CloseCode {
+    NormalClosure = 1000,
+    ProtocolError = 1002,
+    UnsupportedData = 1003,
+    MessageTooBig = 1009,
+};
+
+/// Adds a namespace declaration to the top-level element of \a data
+/// unless it already has one.
+
+static QByteArray declareNamespace(const QByteArray &data, const char *attribute, const char *ns)
+{
+    const int end = data.indexOf('>');
+    const QByteArray startTag = data.left(end);
+    if (end < 0 || startTag.contains(QByteArray(attribute) + "="))
+        return data;
+
+    int pos = 1;
+    while (pos < end && data.at(pos) != ' ' && data.at(pos) != '/')
+        ++pos;
+
+    QByteArray result = data;
+    result.insert(pos, QString(" %1=\"%2\"").arg(QLatin1String(attribute), QLatin1String(ns)).toUtf8());
+    return result;
+}
+
+QXmppIncomingWebSocket::QXmppIncomingWebSocket(QTcpSocket *socket, const QString &domain, QObject *parent)
+    : QXmppIncomingClient(0, domain, parent),
+    m_domain(domain),
+    m_fragmented(false),
+    m_handshakeDone(false),
+    m_isConnected(true),
+    m_socket(socket)
+{
+    bool check;
+    Q_UNUSED(check);
+
+    m_socket->setParent(this);
+    check = connect(m_socket, SIGNAL(disconnected()),
+                    this, SLOT(socketDisconnected()));
+    Q_ASSERT(check);
+
+    check = connect(m_socket, SIGNAL(readyRead()),
+                    this, SLOT(socketReadyRead()));
+    Q_ASSERT(check);
+}
+
+void QXmppIncomingWebSocket::closeSocket(quint16 code)
+{
+    QByteArray payload(2, '\0');
+    qToBigEndian(code, reinterpret_cast<uchar*>(payload.data()));
+    writeFrame(CloseFrame, payload);
+    m_socket->disconnectFromHost();
+}
+
+void QXmppIncomingWebSocket::disconnectFromHost()
+{
+    QXmppStream::disconnectFromHost();
+    if (m_isConnected) {
+        m_isConnected = false;
+        if (m_socket->state() == QAbstractSocket::ConnectedState)
+            closeSocket(NormalClosure);
+        emit disconnected();
+    }
+}
+
+void QXmppIncomingWebSocket::handleMessage(const QByteArray &message)
+{
+    QDomDocument doc;
+    if (!doc.setContent(message, true)) {
+        warning("Received invalid XML over WebSocket");
+        disconnectFromHost();
+        return;
+    }
+
+    const QDomElement element = doc.documentElement();
+    if (element.namespaceURI() == ns_framing && element.tagName() == "open") {
+        handleStream(element);
+    } else if (element.namespaceURI() == ns_framing && element.tagName() == "close") {
+        disconnectFromHost();
+    } else {
+        handleStanza(element);
+    }
+}
+
+void QXmppIncomingWebSocket::handleStanza(const QDomElement &stanza)
+{
+    QXmppIncomingClient::handleStanza(stanza);
+}
+
+void QXmppIncomingWebSocket::handleStream(const QDomElement &stream)
+{
+    QXmppIncomingClient::handleStream(stream);
+}
+
+bool QXmppIncomingWebSocket::isConnected() const
+{
+    return m_isConnected && !QXmppUtils::jidToResource(jid()).isEmpty();
+}
+
+bool QXmppIncomingWebSocket::readFrames()
+{
+    for (;;) {
+        if (m_buffer.size() < 2)
+            return true;
+
+        const uchar *header = reinterpret_cast<const uchar*>(m_buffer.constData());
+        const bool final = header[0] & 0x80;
+        const bool reserved = header[0] & 0x70;
+        const quint8 opcode = header[0] & 0x0f;
+        const bool masked = header[1] & 0x80;
+        quint64 length = header[1] & 0x7f;
+        int headerSize = 2;
+        if (length == 126) {
+            headerSize = 4;
+            if (m_buffer.size() < headerSize)
+                return true;
+            length = qFromBigEndian<quint16>(header + 2);
+        } else if (length == 127) {
+            headerSize = 10;
+            if (m_buffer.size() < headerSize)
+                return true;
+            length = qFromBigEndian<quint64>(header + 2);
+
+            // the most significant bit of a 64-bit length must be 0
+            if (length >> 63) {
+                closeSocket(ProtocolError);
+                return false;
+            }
+        }
+
+        // client frames must be masked, no extension was negotiated,
+        // control frames are short and cannot be fragmented, and only
+        // a fragmented message can be continued
+        const bool control = opcode & 0x08;
+        if (!masked || reserved ||
+            (control && (!final || length > quint64(maxControlSize))) ||
+            (opcode == ContinuationFrame && !m_fragmented) ||
+            ((opcode == TextFrame || opcode == BinaryFrame) && m_fragmented)) {
+            closeSocket(ProtocolError);
+            return false;
+        }
+        if (length > quint64(maxMessageSize - m_message.size())) {
+            closeSocket(MessageTooBig);
+            return false;
+        }
+        if (m_buffer.size() < headerSize + 4 + int(length))
+            return true;
+
+        const uchar *mask = header + headerSize;
+        QByteArray payload = m_buffer.mid(headerSize + 4, length);
+        char *data = payload.data();
+        for (int i = 0; i < payload.size(); ++i)
+            data[i] ^= mask[i % 4];
+        m_buffer.remove(0, headerSize + 4 + length);
+
+        switch (opcode) {
+        case ContinuationFrame:
+        case TextFrame:
+            m_message += payload;
+            m_fragmented = !final;
+            if (final) {
+                const QByteArray message = m_message;
+                m_message.clear();
+                handleMessage(message);
+                if (!m_isConnected)
+                    return false;
+            }
+            break;
+        case PingFrame:
+            writeFrame(PongFrame, payload);
+            break;
+        case PongFrame:
+            break;
+        case CloseFrame:
+            disconnectFromHost();
+            return false;
+        case BinaryFrame:
+            closeSocket(UnsupportedData);
+            return false;
+        default:
+            closeSocket(ProtocolError);
+            return false;
+        }
+    }
+}
+
+bool QXmppIncomingWebSocket::readHandshake()
+{
+    const int end = m_buffer.indexOf("\r\n\r\n");
+    if (end < 0) {
+        if (m_buffer.size() > maxHandshakeSize) {
+            m_socket->disconnectFromHost();
+            return false;
+        }
+        return true;
+    }
+
+    const QStringList lines = QString::fromLatin1(m_buffer.left(end)).split("\r\n");
+    m_buffer.remove(0, end + 4);
+
+    QHash<QString, QString> headers;
+    for (int i = 1; i < lines.size(); ++i) {
+        const int pos = lines[i].indexOf(':');
+        if (pos > 0)
+            headers.insert(lines[i].left(pos).trimmed().toLower(), lines[i].mid(pos + 1).trimmed());
+    }
+
+    const QStringList protocols = headers.value("sec-websocket-protocol").split(QRegExp("\\s*,\\s*"));
+    const QString key = headers.value("sec-websocket-key");
+    if (!lines.first().startsWith("GET ") ||
+        headers.value("upgrade").toLower() != "websocket" ||
+        !headers.value("connection").toLower().contains("upgrade") ||
+        headers.value("sec-websocket-version") != "13" ||
+        !protocols.contains("xmpp") ||
+        key.isEmpty()) {
+        m_socket->write("HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        m_socket->disconnectFromHost();
+        return false;
+    }
+
+    const QByteArray accept = QCryptographicHash::hash(key.toLatin1() + websocketGuid, QCryptographicHash::Sha1).toBase64();
+    m_socket->write("HTTP/1.1 101 Switching Protocols\r\n"
+                    "Upgrade: websocket\r\n"
+                    "Connection: Upgrade\r\n"
+                    "Sec-WebSocket-Accept: " + accept + "\r\n"
+                    "Sec-WebSocket-Protocol: xmpp\r\n"
+                    "\r\n");
+    m_handshakeDone = true;
+    return true;
+}
+
+bool QXmppIncomingWebSocket::sendData(const QByteArray &data)
+{
+    if (!m_isConnected || !m_handshakeDone)
+        return false;
+
+    // translate stream-level data to RFC 7395 framing
+    QByteArray message;
+    if (data.startsWith("<?xml")) {
+        QRegExp rx("id=['\"]([^'\"]+)['\"]");
+        const QString id = rx.indexIn(QString::fromUtf8(data)) >= 0 ? rx.cap(1) : QXmppUtils::generateStanzaHash();
+        message = QString("<open xmlns=\"%1\" from=\"%2\" id=\"%3\" version=\"1.0\" xml:lang=\"en\"/>").arg(
+            ns_framing,
+            m_domain,
+            id).toUtf8();
+    } else if (data == "</stream:stream>") {
+        message = QString("<close xmlns=\"%1\"/>").arg(ns_framing).toUtf8();
+    } else if (data.startsWith("<stream:")) {
+        // bind the stream prefix, which is no longer declared by a stream header
+        message = declareNamespace(data, "xmlns:stream", ns_stream);
+    } else if (data.startsWith("<iq") || data.startsWith("<message") || data.startsWith("<presence")) {
+        // declare the default namespace, which is no longer inherited from the stream
+        message = declareNamespace(data, "xmlns", ns_client);
+    } else if (!data.isEmpty()) {
+        message = data;
+    }
+
+    if (!message.isEmpty()) {
+        logSent(QString::fromUtf8(message));
+        writeFrame(TextFrame, message);
+    }
+    return true;
+}
+
+void QXmppIncomingWebSocket::socketDisconnected()
+{
+    if (m_isConnected) {
+        m_isConnected = false;
+        emit disconnected();
+    }
+}
+
+void QXmppIncomingWebSocket::socketReadyRead()
+{
+    m_buffer += m_socket->readAll();
+    if (!m_handshakeDone && !readHandshake())
+        return;
+    if (m_handshakeDone)
+        readFrames();
+}
+
+void QXmppIncomingWebSocket::writeFrame(quint8 opcode, const QByteArray &payload)
+{
+    QByteArray header;
+    header.append(char(0x80 | opcode));
+    if (payload.size() < 126) {
+        header.append(char(payload.size()));
+    } else if (payload.size() < 65536) {
+        header.append(char(126));
+        header.append(char((payload.size() >> 8) & 0xff));
+        header.append(char(payload.size() & 0xff));
+    } else {
+        header.append(char(127));
+        for (int shift = 56; shift >= 0; shift -= 8)
+            header.append(char((quint64(payload.size()) >> shift) & 0xff));
+    }
+    m_socket->write(header);
+    m_socket->write(payload);
+}
@@ -0,0 +1,64 @@
+/*
+ * xmpp-share-server
+ * Copyright (C) 2010-2013 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QXMPPINCOMINGWEBSOCKET_H
+#define QXMPPINCOMINGWEBSOCKET_H
+
+#include "QXmppIncomingClient.h"
+
+class QTcpSocket;
+
+class QXmppIncomingWebSocket : public QXmppIncomingClient
+{
+    Q_OBJECT
+
+public:
+    QXmppIncomingWebSocket(QTcpSocket *socket, const QString &domain, QObject *parent = 0);
+
+    /// \cond
+    void handleStanza(const QDomElement &element);
+    void handleStream(const QDomElement &element);
+    bool isConnected() const;
+    /// \endcond
+
+public slots:
+    void disconnectFromHost();
+    bool sendData(const QByteArray&);
+
+private slots:
+    void socketDisconnected();
+    void socketReadyRead();
+
+private:
+    void closeSocket(quint16 code);
+    void handleMessage(const QByteArray &message);
+    bool readFrames();
+    bool readHandshake();
+    void writeFrame(quint8 opcode, const QByteArray &payload);
+
+    QByteArray m_buffer;
+    QString m_domain;
+    bool m_fragmented;
+    bool m_handshakeDone;
+    bool m_isConnected;
+    QByteArray m_message;
+    QTcpSocket *m_socket;
+};
+
+#endif
@@ -17,10 +17,18 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstring>
+#include <zlib.h>
+
 #include <QBuffer>
 #include <QDomElement>
+#include <QElapsedTimer>
+#include <QSqlDatabase>
+#include <QSqlQuery>
 #include <QStringList>
+#include <QTimer>
 
+#include "QDjango.h"
 #include "QDjangoQuerySet.h"
 
 #include "QXmppArchiveIq.h"
@@ -34,6 +42,189 @@
 #include "mod_archive.h"
 #include "mod_presence.h"
 
+static const char * ns_mam2 = "urn:xmpp:mam:2";
+static const char * ns_forward0 = "urn:xmpp:forward:0";
+static const char * ns_fulltext0 = "urn:xmpp:fulltext:0";
+
+// maximum number of messages returned by a single MAM query
+static const int mamMaxResults = 100;
+
+// number of offline messages delivered per event loop iteration
+static const int offlineChunkSize = 100;
+
+// number of expired offline messages removed per event loop iteration
+static const int purgeBatchSize = 500;
+
+// number of archive collections removed per DELETE
+static const int collectionBatchSize = 100;
+
+// number of expired archive messages removed per event loop iteration
+static const int retentionBatchSize = 500;
+
+// number of full text search hits loaded per query
+static const int searchChunkSize = 200;
+
+// number of archived messages added to the search index per event loop iteration
+static const int rebuildBatchSize = 500;
+
+// preset dictionary for compressed bodies and payloads, deflate favours
+// the strings at the end so the most common ones come last
+static const char compressionDictionary[] =
+    "<subject></subject><thread></thread>"
+    "<x xmlns=\"jabber:x:event\"><composing/></x>"
+    "<request xmlns=\"urn:xmpp:receipts\"/>"
+    "<active xmlns=\"http://jabber.org/protocol/chatstates\"/>"
+    "<delay xmlns=\"urn:xmpp:delay\" stamp=\"\"/>"
+    "<message xmlns=\"jabber:client\" type=\"chat\" id=\"\" to=\"\" from=\"\">"
+    "<body></body></message>"
+    "http://www. have this that with what but not was are you for and the ";
+
+// bounds on the length of search terms
+static const int minTermLength = 2;
+static const int maxTermLength = 64;
+
+/// Removes up to \a batchSize rows matching \a qs using a single DELETE.
+///
+/// Returns the number of removed rows, or -1 on error.
+
+template <class T>
+int removeBatch(QDjangoQuerySet<T> qs, int batchSize)
+{
+    QList<QVariant> ids;
+    foreach (const QList<QVariant> &values, qs.limit(0, batchSize).valuesList(QStringList() << "id"))
+        ids << values[0];
+    if (ids.isEmpty())
+        return 0;
+
+    QDjangoQuerySet<T> batch;
+    batch = batch.filter(QDjangoWhere("id", QDjangoWhere::IsIn, ids));
+    return batch.remove() ? ids.size() : -1;
+}
+
+/// Splits \a text into lowercase search terms, without duplicates.
+///
+
+static QStringList searchTerms(const QString &text)
+{
+    QStringList terms;
+    QString term;
+    for (int i = 0; i <= text.size(); ++i) {
+        if (i < text.size() && text.at(i).isLetterOrNumber()) {
+            term += text.at(i).toLower();
+        } else if (!term.isEmpty()) {
+            if (term.size() >= minTermLength)
+                terms << term.left(maxTermLength);
+            term.clear();
+        }
+    }
+    terms.removeDuplicates();
+    return terms;
+}
+
+/// Returns the FTS5 token which identifies the messages archived by
+/// \a bareJid, the hex encoding of its UTF-8 bytes.
+///
+/// This matches SQLite's hex() function, up to the case which the
+/// tokenizer folds.
+
+static QString searchOwner(const QString &bareJid)
+{
+    return QString::fromLatin1(bareJid.toUtf8().toHex());
+}
+
+/// Compresses \a raw using raw deflate and the preset dictionary.
+///
+/// Returns an empty array on error.
+
+static QByteArray deflateData(const QByteArray &raw)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return QByteArray();
+
+    QByteArray packed;
+    packed.resize(deflateBound(&stream, raw.size()));
+    stream.next_in = (Bytef*)raw.constData();
+    stream.avail_in = raw.size();
+    stream.next_out = (Bytef*)packed.data();
+    stream.avail_out = packed.size();
+    if (deflateSetDictionary(&stream, (const Bytef*)compressionDictionary, sizeof(compressionDictionary) - 1) == Z_OK &&
+        deflate(&stream, Z_FINISH) == Z_STREAM_END)
+        packed.resize(stream.total_out);
+    else
+        packed.clear();
+    deflateEnd(&stream);
+    return packed;
+}
+
+/// Decompresses \a packed which was compressed by deflateData().
+///
+/// Returns an empty array on error.
+
+static QByteArray inflateData(const QByteArray &packed)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+        return QByteArray();
+
+    QByteArray raw;
+    char buffer[4096];
+    int ret = inflateSetDictionary(&stream, (const Bytef*)compressionDictionary, sizeof(compressionDictionary) - 1);
+    stream.next_in = (Bytef*)packed.constData();
+    stream.avail_in = packed.size();
+    while (ret == Z_OK) {
+        stream.next_out = (Bytef*)buffer;
+        stream.avail_out = sizeof(buffer);
+        ret = inflate(&stream, Z_NO_FLUSH);
+        if (ret == Z_OK || ret == Z_STREAM_END)
+            raw.append(buffer, sizeof(buffer) - stream.avail_out);
+    }
+    inflateEnd(&stream);
+    return ret == Z_STREAM_END ? raw : QByteArray();
+}
+
+/// Returns a comma-separated list of \a count SQL placeholders.
+///
+
+static QString placeholders(int count)
+{
+    QStringList list;
+    for (int i = 0; i < count; ++i)
+        list << QLatin1String("?");
+    return list.join(", ");
+}
+
+/// A position in the chronological order of archived messages, which
+/// is that of their dates then of their IDs.
+
+struct ArchivePosition
+{
+    ArchivePosition() : id(0) {}
+    bool isNull() const { return !id; }
+
+    QDateTime date;
+    int id;
+};
+
+/// Returns the condition for messages which come after \a position if
+/// \a op is GreaterThan, or before it if \a op is LessThan.
+
+static QDjangoWhere positionWhere(const ArchivePosition &position, QDjangoWhere::Operation op)
+{
+    return QDjangoWhere("date", op, position.date) ||
+           (QDjangoWhere("date", QDjangoWhere::Equals, position.date) && QDjangoWhere("id", op, position.id));
+}
+
+/// Returns the SQL equivalent of positionWhere(), whose placeholders are
+/// to be bound to the position's date, date again and ID.
+
+static QString positionSql(const QString &op)
+{
+    return QString(" AND (archivemessage.date %1 ? OR (archivemessage.date = ? AND archivemessage.id %1 ?))").arg(op);
+}
+
 template <class T1, class T2>
 void rsmFilter(QDjangoQuerySet<T1> &qs, const QXmppResultSetQuery &rsmQuery, QList<T2> &results, QXmppResultSetReply &rsmReply)
 {
@@ -100,6 +291,259 @@ void rsmFilter(QDjangoQuerySet<T1> &qs, const QXmppResultSetQuery &rsmQuery, QLi
     }
 }
 
+class MamQueryIq : public QXmppIq
+{
+public:
+    MamQueryIq();
+
+    QString queryId() const;
+    void setQueryId(const QString &queryId);
+
+    QString with() const;
+    QDateTime start() const;
+    QDateTime end() const;
+    QString fullText() const;
+
+    QXmppResultSetQuery resultSetQuery() const;
+
+    bool isComplete() const;
+    void setComplete(bool complete);
+
+    QXmppResultSetReply resultSetReply() const;
+    void setResultSetReply(const QXmppResultSetReply &rsm);
+
+    static bool isMamQueryIq(const QDomElement &element);
+
+protected:
+    void parseElementFromChild(const QDomElement &element);
+    void toXmlElementFromChild(QXmlStreamWriter *writer) const;
+
+private:
+    bool m_complete;
+    QString m_queryId;
+    QString m_with;
+    QDateTime m_start;
+    QDateTime m_end;
+    QString m_fullText;
+    QXmppResultSetQuery m_rsmQuery;
+    QXmppResultSetReply m_rsmReply;
+};
+
+MamQueryIq::MamQueryIq()
+    : m_complete(false)
+{
+}
+
+QString MamQueryIq::queryId() const
+{
+    return m_queryId;
+}
+
+void MamQueryIq::setQueryId(const QString &queryId)
+{
+    m_queryId = queryId;
+}
+
+QString MamQueryIq::with() const
+{
+    return m_with;
+}
+
+QDateTime MamQueryIq::start() const
+{
+    return m_start;
+}
+
+QDateTime MamQueryIq::end() const
+{
+    return m_end;
+}
+
+/// Returns the XEP-0431 full text search string.
+///
+
+QString MamQueryIq::fullText() const
+{
+    return m_fullText;
+}
+
+QXmppResultSetQuery MamQueryIq::resultSetQuery() const
+{
+    return m_rsmQuery;
+}
+
+bool MamQueryIq::isComplete() const
+{
+    return m_complete;
+}
+
+void MamQueryIq::setComplete(bool complete)
+{
+    m_complete = complete;
+}
+
+QXmppResultSetReply MamQueryIq::resultSetReply() const
+{
+    return m_rsmReply;
+}
+
+void MamQueryIq::setResultSetReply(const QXmppResultSetReply &rsm)
+{
+    m_rsmReply = rsm;
+}
+
+bool MamQueryIq::isMamQueryIq(const QDomElement &element)
+{
+    const QDomElement queryElement = element.firstChildElement("query");
+    return queryElement.namespaceURI() == ns_mam2;
+}
+
+void MamQueryIq::parseElementFromChild(const QDomElement &element)
+{
+    const QDomElement queryElement = element.firstChildElement("query");
+    m_queryId = queryElement.attribute("queryid");
+
+    // parse the search form, we only need the field values
+    QDomElement fieldElement = queryElement.firstChildElement("x").firstChildElement("field");
+    while (!fieldElement.isNull()) {
+        const QString var = fieldElement.attribute("var");
+        const QString value = fieldElement.firstChildElement("value").text();
+        if (var == QLatin1String("with"))
+            m_with = value;
+        else if (var == QLatin1String("start"))
+            m_start = QXmppUtils::datetimeFromString(value);
+        else if (var == QLatin1String("end"))
+            m_end = QXmppUtils::datetimeFromString(value);
+        else if (var == QString("{%1}fulltext").arg(ns_fulltext0))
+            m_fullText = value;
+        fieldElement = fieldElement.nextSiblingElement("field");
+    }
+
+    m_rsmQuery.parse(queryElement.firstChildElement("set"));
+}
+
+void MamQueryIq::toXmlElementFromChild(QXmlStreamWriter *writer) const
+{
+    if (type() != QXmppIq::Result)
+        return;
+
+    writer->writeStartElement("fin");
+    writer->writeAttribute("xmlns", ns_mam2);
+    if (m_complete)
+        writer->writeAttribute("complete", "true");
+    m_rsmReply.toXml(writer);
+    writer->writeEndElement();
+}
+
+/// A message carrying a single archived message in response to a MAM query.
+///
+/// The payload is written straight from the database row, without going
+/// through an intermediate DOM representation.
+
+class MamResultMessage : public QXmppMessage
+{
+public:
+    MamResultMessage(const QString &to, const QString &queryId, const ArchiveMessage &message);
+    void toXml(QXmlStreamWriter *writer) const;
+
+private:
+    QString m_queryId;
+    QString m_uid;
+    QString m_from;
+    QString m_to;
+    QString m_body;
+    QDateTime m_date;
+};
+
+MamResultMessage::MamResultMessage(const QString &to, const QString &queryId, const ArchiveMessage &message)
+    : m_queryId(queryId)
+{
+    setFrom(QXmppUtils::jidToBareJid(to));
+    setTo(to);
+
+    const ArchiveChat *chat = message.chat();
+    m_uid = message.pk().toString();
+    m_from = message.isReceived() ? chat->with() : chat->jid();
+    m_to = message.isReceived() ? chat->jid() : chat->with();
+    m_body = message.body();
+    m_date = message.date();
+}
+
+void MamResultMessage::toXml(QXmlStreamWriter *writer) const
+{
+    writer->writeStartElement("message");
+    helperToXmlAddAttribute(writer, "from", from());
+    helperToXmlAddAttribute(writer, "to", to());
+
+    writer->writeStartElement("result");
+    writer->writeAttribute("xmlns", ns_mam2);
+    helperToXmlAddAttribute(writer, "queryid", m_queryId);
+    writer->writeAttribute("id", m_uid);
+
+    writer->writeStartElement("forwarded");
+    writer->writeAttribute("xmlns", ns_forward0);
+
+    writer->writeStartElement("delay");
+    writer->writeAttribute("xmlns", ns_delayed_delivery);
+    writer->writeAttribute("stamp", QXmppUtils::datetimeToString(m_date));
+    writer->writeEndElement();
+
+    writer->writeStartElement("message");
+    writer->writeAttribute("xmlns", ns_client);
+    writer->writeAttribute("from", m_from);
+    writer->writeAttribute("to", m_to);
+    writer->writeAttribute("type", "chat");
+    writer->writeTextElement("body", m_body);
+    writer->writeEndElement();
+
+    writer->writeEndElement();
+    writer->writeEndElement();
+    writer->writeEndElement();
+}
+
+/// An archived message as retrieved for XEP-0136, whose body may still
+/// need to be decompressed.
+
+class PackedArchiveMessage : public QXmppArchiveMessage
+{
+public:
+    PackedArchiveMessage()
+    {
+    }
+
+    PackedArchiveMessage(const ArchiveMessage &message)
+        : QXmppArchiveMessage(message)
+        , compressed(message.compressed())
+    {
+    }
+
+    QByteArray compressed;
+};
+
+/// A stanza which was serialized when it was stored, it is written
+/// to the stream as is.
+
+class SerializedStanza : public QXmppMessage
+{
+public:
+    SerializedStanza(const QString &to, const QByteArray &data);
+    void toXml(QXmlStreamWriter *writer) const;
+
+private:
+    QByteArray m_data;
+};
+
+SerializedStanza::SerializedStanza(const QString &to, const QByteArray &data)
+    : m_data(data)
+{
+    setTo(to);
+}
+
+void SerializedStanza::toXml(QXmlStreamWriter *writer) const
+{
+    writer->device()->write(m_data);
+}
+
 ArchiveChat::ArchiveChat(QObject *parent)
     : QDjangoModel(parent)
 {
@@ -125,7 +569,8 @@ void ArchiveChat::setThreadString(const QString &thread)
     QXmppArchiveChat::setThread(thread);
 }
 
-ArchiveMessage::ArchiveMessage()
+ArchiveMessage::ArchiveMessage(QObject *parent)
+    : QDjangoModel(parent)
 {
     setForeignKey("chat", new ArchiveChat(this));
 }
@@ -140,6 +585,62 @@ void ArchiveMessage::setChat(ArchiveChat *chat)
     setForeignKey("chat", chat);
 }
 
+QByteArray ArchiveMessage::compressed() const
+{
+    return m_compressed;
+}
+
+void ArchiveMessage::setCompressed(const QByteArray &compressed)
+{
+    m_compressed = compressed;
+}
+
+ArchiveTerm::ArchiveTerm(QObject *parent)
+    : QDjangoModel(parent)
+{
+    setForeignKey("message", new ArchiveMessage(this));
+}
+
+QString ArchiveTerm::jid() const
+{
+    return m_jid;
+}
+
+void ArchiveTerm::setJid(const QString &jid)
+{
+    m_jid = jid;
+}
+
+ArchiveMessage* ArchiveTerm::message() const
+{
+    return qobject_cast<ArchiveMessage*>(foreignKey("message"));
+}
+
+void ArchiveTerm::setMessage(ArchiveMessage *message)
+{
+    setForeignKey("message", message);
+}
+
+QString ArchiveTerm::term() const
+{
+    return m_term;
+}
+
+void ArchiveTerm::setTerm(const QString &term)
+{
+    m_term = term;
+}
+
+QByteArray OfflineMessage::compressed() const
+{
+    return m_compressed;
+}
+
+void OfflineMessage::setCompressed(const QByteArray &compressed)
+{
+    m_compressed = compressed;
+}
+
 QString OfflineMessage::data() const
 {
     return m_data;
@@ -170,7 +671,383 @@ void OfflineMessage::setStamp(const QDateTime &stamp)
     m_stamp = stamp;
 }
 
-static void saveMessage(const QXmppMessage &message, const QDateTime &now, bool received)
+class XmppServerArchivePrivate
+{
+public:
+    XmppServerArchivePrivate(XmppServerArchive *qq);
+    int countMessages(QDjangoQuerySet<ArchiveMessage> qs, const QString &bareJid, const QString &text) const;
+    QString decode(const QString &data, const QByteArray &compressed);
+    QByteArray encode(const QString &text);
+    QList<ArchiveMessage*> fetchMessages(QDjangoQuerySet<ArchiveMessage> qs, const QString &bareJid, const QString &text, const ArchivePosition &after, const ArchivePosition &before, bool backwards, int limit) const;
+    void indexMessage(const QString &bareJid, const QVariant &messageId, const QString &body);
+    ArchivePosition messagePosition(const QString &bareJid, const QString &uid) const;
+    bool offlineQuotaReached(const QString &bareJid, int size) const;
+    int rebuildIndex(int afterId, int batchSize);
+    int removeCollections(QDjangoQuerySet<ArchiveChat> qs, int batchSize);
+    int removeEmptyCollections(const QDateTime &cutoff, int batchSize);
+    int removeMessages(QDjangoQuerySet<ArchiveMessage> qs, int batchSize);
+    void saveMessage(const QXmppMessage &message, const QDateTime &now, bool received);
+    QList<ArchivePosition> search(const QString &bareJid, const QString &text, const ArchivePosition &after, const ArchivePosition &before, bool backwards, int limit) const;
+
+    // whether full text search uses SQLite's FTS5 instead of ArchiveTerm
+    bool fts5;
+
+    // range of message IDs which still need to be added to the index
+    int rebuildFrom;
+    int rebuildTo;
+
+    // bytes before and after compression, used to report the ratio
+    qint64 compressionIn;
+    qint64 compressionOut;
+
+    // bare JIDs with pending offline messages
+    QStringList offlineQueue;
+    QTimer *purgeTimer;
+    int purgeCount;
+    QTimer *retentionTimer;
+    int retentionCount;
+
+    // config
+    bool compression;
+    int offlineExpiry;
+    int offlineMaxCount;
+    int offlineMaxSize;
+    int retention;
+
+private:
+    XmppServerArchive *q;
+};
+
+XmppServerArchivePrivate::XmppServerArchivePrivate(XmppServerArchive *qq)
+    : rebuildFrom(0)
+    , rebuildTo(0)
+    , compressionIn(0)
+    , compressionOut(0)
+    , q(qq)
+{
+}
+
+/// Returns the number of messages matching \a qs which contain all the
+/// terms of \a text.
+
+int XmppServerArchivePrivate::countMessages(QDjangoQuerySet<ArchiveMessage> qs, const QString &bareJid, const QString &text) const
+{
+    if (text.isEmpty())
+        return qs.count();
+
+    int count = 0;
+    ArchivePosition after;
+    while (true) {
+        const QList<ArchivePosition> hits = search(bareJid, text, after, ArchivePosition(), false, searchChunkSize);
+        if (hits.isEmpty())
+            break;
+
+        QList<QVariant> chunk;
+        foreach (const ArchivePosition &hit, hits)
+            chunk << hit.id;
+        count += qs.filter(QDjangoWhere("id", QDjangoWhere::IsIn, chunk)).count();
+        if (hits.size() < searchChunkSize)
+            break;
+        after = hits.last();
+    }
+    return count;
+}
+
+/// Returns the plain text for the stored \a data, or for the \a compressed
+/// data if it is not empty.
+
+QString XmppServerArchivePrivate::decode(const QString &data, const QByteArray &compressed)
+{
+    if (compressed.isEmpty())
+        return data;
+
+    QElapsedTimer timer;
+    timer.start();
+    const QString text = QString::fromUtf8(inflateData(compressed));
+    q->updateCounter("archive.compression.decoded");
+    q->updateCounter("archive.compression.decode_usec", timer.nsecsElapsed() / 1000);
+    return text;
+}
+
+/// Returns the compressed data to store for the given \a text, or an
+/// empty array if the text is to be stored as is.
+///
+/// If compression is enabled, the text is stored compressed unless this
+/// does not save any space.
+
+QByteArray XmppServerArchivePrivate::encode(const QString &text)
+{
+    if (!compression || text.isEmpty())
+        return QByteArray();
+
+    QElapsedTimer timer;
+    timer.start();
+    const QByteArray raw = text.toUtf8();
+    QByteArray compressed = deflateData(raw);
+    q->updateCounter("archive.compression.encode_usec", timer.nsecsElapsed() / 1000);
+    if (compressed.isEmpty() || compressed.size() >= raw.size())
+        compressed.clear();
+    else
+        q->updateCounter("archive.compression.encoded");
+
+    compressionIn += raw.size();
+    compressionOut += compressed.isEmpty() ? raw.size() : compressed.size();
+    q->setGauge("archive.compression.ratio", double(compressionOut) / double(compressionIn));
+    return compressed;
+}
+
+/// Fetches up to \a limit messages matching \a qs which come after
+/// \a after and before \a before, unless these are null. Messages are
+/// returned in chronological order, or in reverse chronological order if
+/// \a backwards is true. If \a text is not empty, only messages which
+/// contain all of its terms are returned.
+
+QList<ArchiveMessage*> XmppServerArchivePrivate::fetchMessages(QDjangoQuerySet<ArchiveMessage> qs, const QString &bareJid, const QString &text, const ArchivePosition &after, const ArchivePosition &before, bool backwards, int limit) const
+{
+    // message IDs need not follow their dates, for instance for imported
+    // messages, so paging is on the date then the ID
+    const QStringList order = backwards ? (QStringList() << "-date" << "-id") : (QStringList() << "date" << "id");
+
+    QList<ArchiveMessage*> messages;
+    if (text.isEmpty()) {
+        if (!before.isNull())
+            qs = qs.filter(positionWhere(before, QDjangoWhere::LessThan));
+        if (!after.isNull())
+            qs = qs.filter(positionWhere(after, QDjangoWhere::GreaterThan));
+        qs = qs.orderBy(order).selectRelated().limit(0, limit);
+        for (int i = 0; i < qs.size(); ++i) {
+            ArchiveMessage *message = qs.at(i);
+            if (!message)
+                break;
+            messages << message;
+        }
+        return messages;
+    }
+
+    // walk the search hits in paging order a chunk at a time, and load
+    // the messages which also match the other criteria
+    ArchivePosition afterHit = after;
+    ArchivePosition beforeHit = before;
+    while (messages.size() < limit) {
+        const QList<ArchivePosition> hits = search(bareJid, text, afterHit, beforeHit, backwards, searchChunkSize);
+        if (hits.isEmpty())
+            break;
+
+        QList<QVariant> chunk;
+        foreach (const ArchivePosition &hit, hits)
+            chunk << hit.id;
+        QDjangoQuerySet<ArchiveMessage> page = qs.filter(QDjangoWhere("id", QDjangoWhere::IsIn, chunk));
+        page = page.orderBy(order).selectRelated();
+        for (int i = 0; i < page.size() && messages.size() < limit; ++i) {
+            ArchiveMessage *message = page.at(i);
+            if (!message)
+                break;
+            messages << message;
+        }
+
+        if (hits.size() < searchChunkSize)
+            break;
+        if (backwards)
+            beforeHit = hits.last();
+        else
+            afterHit = hits.last();
+    }
+    return messages;
+}
+
+/// Adds the message with the given \a messageId and \a body to the full
+/// text search index of \a bareJid.
+
+void XmppServerArchivePrivate::indexMessage(const QString &bareJid, const QVariant &messageId, const QString &body)
+{
+    QSqlQuery query(QDjango::database());
+    if (fts5) {
+        query.prepare("INSERT INTO archivemessage_search (rowid, body, owner) VALUES (?, ?, ?)");
+        query.addBindValue(messageId);
+        query.addBindValue(body);
+        query.addBindValue(searchOwner(bareJid));
+        query.exec();
+        return;
+    }
+
+    const QStringList terms = searchTerms(body);
+    if (terms.isEmpty())
+        return;
+
+    QVariantList jids, termValues, messageIds;
+    foreach (const QString &term, terms) {
+        jids << bareJid;
+        termValues << term;
+        messageIds << messageId;
+    }
+    query.prepare("INSERT INTO archiveterm (jid, term, message_id) VALUES (?, ?, ?)");
+    query.addBindValue(jids);
+    query.addBindValue(termValues);
+    query.addBindValue(messageIds);
+    query.execBatch();
+}
+
+/// Returns the position of the message archived by \a bareJid whose ID
+/// is \a uid, or a null position if there is no such message.
+
+ArchivePosition XmppServerArchivePrivate::messagePosition(const QString &bareJid, const QString &uid) const
+{
+    ArchivePosition position;
+    bool ok;
+    const int id = uid.toInt(&ok);
+    if (!ok)
+        return position;
+
+    QDjangoQuerySet<ArchiveMessage> qs;
+    qs = qs.filter(QDjangoWhere("chat__jid", QDjangoWhere::Equals, bareJid));
+    ArchiveMessage message;
+    if (qs.get(QDjangoWhere("id", QDjangoWhere::Equals, id), &message)) {
+        position.date = message.date();
+        position.id = id;
+    }
+    return position;
+}
+
+/// Adds up to \a batchSize archived messages following \a afterId to the
+/// full text search index, in a single transaction.
+///
+/// Returns the ID of the last indexed message, \a afterId if there was
+/// nothing left to index, or -1 on error.
+
+int XmppServerArchivePrivate::rebuildIndex(int afterId, int batchSize)
+{
+    const QString from("FROM archivemessage INNER JOIN archivechat ON archivechat.id = archivemessage.chat_id "
+                       "WHERE archivemessage.id > ? AND archivemessage.id <= ?");
+    const int lastId = qMin(afterId + batchSize, rebuildTo);
+
+    QSqlDatabase db = QDjango::database();
+    QSqlQuery query(db);
+    query.setForwardOnly(true);
+    db.transaction();
+
+    // plain bodies are copied by the database, the owner is computed
+    // the same way as searchOwner()
+    if (fts5) {
+        query.prepare("INSERT INTO archivemessage_search (rowid, body, owner) "
+                      "SELECT archivemessage.id, archivemessage.body, hex(archivechat.jid) " + from +
+                      " AND archivemessage.compressed IS NULL");
+        query.addBindValue(afterId);
+        query.addBindValue(lastId);
+        if (!query.exec()) {
+            db.rollback();
+            return -1;
+        }
+    }
+
+    // compressed bodies, and all bodies for our own inverted index, need
+    // to be processed one at a time
+    query.prepare("SELECT archivemessage.id, archivemessage.body, archivemessage.compressed, archivechat.jid " + from +
+                  (fts5 ? " AND archivemessage.compressed IS NOT NULL" : ""));
+    query.addBindValue(afterId);
+    query.addBindValue(lastId);
+    if (!query.exec()) {
+        db.rollback();
+        return -1;
+    }
+    while (query.next())
+        indexMessage(query.value(3).toString(), query.value(0), decode(query.value(1).toString(), query.value(2).toByteArray()));
+    db.commit();
+    return lastId;
+}
+
+/// Removes up to \a batchSize collections matching \a qs, along with
+/// their messages and search terms.
+///
+/// Returns the number of removed collections, or -1 on error.
+
+int XmppServerArchivePrivate::removeCollections(QDjangoQuerySet<ArchiveChat> qs, int batchSize)
+{
+    QList<QVariant> chatIds;
+    foreach (const QList<QVariant> &values, qs.limit(0, batchSize).valuesList(QStringList() << "id"))
+        chatIds << values[0];
+    if (chatIds.isEmpty())
+        return 0;
+
+    // the index refers to messages, so it is cleaned up first
+    QSqlQuery query(QDjango::database());
+    query.prepare(QString("DELETE FROM %1 WHERE %2 IN (SELECT id FROM archivemessage WHERE chat_id IN (%3))").arg(
+        fts5 ? "archivemessage_search" : "archiveterm",
+        fts5 ? "rowid" : "message_id",
+        placeholders(chatIds.size())));
+    foreach (const QVariant &chatId, chatIds)
+        query.addBindValue(chatId);
+    if (!query.exec())
+        return -1;
+
+    QDjangoQuerySet<ArchiveMessage> messages;
+    messages = messages.filter(QDjangoWhere("chat_id", QDjangoWhere::IsIn, chatIds));
+    QDjangoQuerySet<ArchiveChat> chats;
+    chats = chats.filter(QDjangoWhere("id", QDjangoWhere::IsIn, chatIds));
+    if (!messages.remove() || !chats.remove())
+        return -1;
+    return chatIds.size();
+}
+
+/// Removes up to \a batchSize collections which started before \a cutoff
+/// and no longer hold any messages.
+///
+/// Returns the number of removed collections, or -1 on error.
+
+int XmppServerArchivePrivate::removeEmptyCollections(const QDateTime &cutoff, int batchSize)
+{
+    QSqlQuery query(QDjango::database());
+    query.setForwardOnly(true);
+    query.prepare("SELECT id FROM archivechat WHERE start < ? AND NOT EXISTS "
+                  "(SELECT 1 FROM archivemessage WHERE archivemessage.chat_id = archivechat.id) LIMIT ?");
+    query.addBindValue(cutoff);
+    query.addBindValue(batchSize);
+    if (!query.exec())
+        return -1;
+
+    QList<QVariant> chatIds;
+    while (query.next())
+        chatIds << query.value(0);
+    if (chatIds.isEmpty())
+        return 0;
+
+    QDjangoQuerySet<ArchiveChat> chats;
+    chats = chats.filter(QDjangoWhere("id", QDjangoWhere::IsIn, chatIds));
+    return chats.remove() ? chatIds.size() : -1;
+}
+
+/// Removes up to \a batchSize messages matching \a qs, along with their
+/// search terms.
+///
+/// Returns the number of removed messages, or -1 on error.
+
+int XmppServerArchivePrivate::removeMessages(QDjangoQuerySet<ArchiveMessage> qs, int batchSize)
+{
+    QList<QVariant> messageIds;
+    foreach (const QList<QVariant> &values, qs.limit(0, batchSize).valuesList(QStringList() << "id"))
+        messageIds << values[0];
+    if (messageIds.isEmpty())
+        return 0;
+
+    // the index refers to messages, so it is cleaned up first
+    QSqlQuery query(QDjango::database());
+    query.prepare(QString("DELETE FROM %1 WHERE %2 IN (%3)").arg(
+        fts5 ? "archivemessage_search" : "archiveterm",
+        fts5 ? "rowid" : "message_id",
+        placeholders(messageIds.size())));
+    foreach (const QVariant &messageId, messageIds)
+        query.addBindValue(messageId);
+    if (!query.exec())
+        return -1;
+
+    QDjangoQuerySet<ArchiveMessage> messages;
+    messages = messages.filter(QDjangoWhere("id", QDjangoWhere::IsIn, messageIds));
+    return messages.remove() ? messageIds.size() : -1;
+}
+
+/// Archives the given \a message and adds it to the search index.
+///
+
+void XmppServerArchivePrivate::saveMessage(const QXmppMessage &message, const QDateTime &now, bool received)
 {
     const QString localJid = QXmppUtils::jidToBareJid(received ? message.to() : message.from());
     const QString remoteJid = QXmppUtils::jidToBareJid(received ? message.from() : message.to());
@@ -194,25 +1071,280 @@ static void saveMessage(const QXmppMessage &message, const QDateTime &now, bool
     }
 
     // save outgoing message
+    const QByteArray compressed = encode(message.body());
     ArchiveMessage msg;
     msg.setProperty("chat_id", chatId);
-    msg.setBody(message.body());
+    msg.setBody(compressed.isEmpty() ? message.body() : QString());
+    msg.setCompressed(compressed);
     msg.setDate(now);
     msg.setReceived(received);
-    msg.save();
+    if (msg.save())
+        indexMessage(localJid, msg.pk(), message.body());
+}
+
+/// Returns the positions of up to \a limit messages archived by \a bareJid
+/// which contain all the terms of \a text, following \a after and
+/// preceding \a before unless these are null, in chronological order or
+/// in reverse chronological order if \a backwards is true.
+
+QList<ArchivePosition> XmppServerArchivePrivate::search(const QString &bareJid, const QString &text, const ArchivePosition &after, const ArchivePosition &before, bool backwards, int limit) const
+{
+    QList<ArchivePosition> hits;
+    const QStringList terms = searchTerms(text);
+    if (terms.isEmpty())
+        return hits;
+
+    QString range;
+    if (!after.isNull())
+        range += positionSql(">");
+    if (!before.isNull())
+        range += positionSql("<");
+    const QString order = backwards ? QString(" ORDER BY archivemessage.date DESC, archivemessage.id DESC") : QString(" ORDER BY archivemessage.date, archivemessage.id");
+
+    QSqlQuery query(QDjango::database());
+    query.setForwardOnly(true);
+    if (fts5) {
+        // the owner is part of the match expression, so FTS5 only
+        // considers the user's own messages
+        QStringList match;
+        match << QString("owner : \"%1\"").arg(searchOwner(bareJid));
+        foreach (const QString &term, terms)
+            match << QString("body : \"%1\"").arg(term);
+        query.prepare(QString("SELECT archivemessage.id, archivemessage.date FROM archivemessage_search"
+                              " JOIN archivemessage ON archivemessage.id = archivemessage_search.rowid"
+                              " WHERE archivemessage_search MATCH ?")
+                      + range + order + QString(" LIMIT ?"));
+        query.addBindValue(match.join(" AND "));
+    } else {
+        // terms are unique per message, so a message matches if it
+        // has as many rows as there are terms
+        query.prepare(QString("SELECT archivemessage.id, archivemessage.date FROM archiveterm"
+                              " JOIN archivemessage ON archivemessage.id = archiveterm.message_id"
+                              " WHERE archiveterm.jid = ? AND archiveterm.term IN (%1)").arg(placeholders(terms.size()))
+                      + range
+                      + QString(" GROUP BY archivemessage.id, archivemessage.date HAVING COUNT(*) = ?")
+                      + order + QString(" LIMIT ?"));
+        query.addBindValue(bareJid);
+        foreach (const QString &term, terms)
+            query.addBindValue(term);
+    }
+    foreach (const ArchivePosition &position, QList<ArchivePosition>() << after << before) {
+        if (!position.isNull()) {
+            query.addBindValue(position.date);
+            query.addBindValue(position.date);
+            query.addBindValue(position.id);
+        }
+    }
+    if (!fts5)
+        query.addBindValue(terms.size());
+    query.addBindValue(limit);
+    if (query.exec()) {
+        while (query.next()) {
+            ArchivePosition hit;
+            hit.id = query.value(0).toInt();
+            hit.date = query.value(1).toDateTime();
+            hits << hit;
+        }
+    }
+    return hits;
+}
+
+/// Returns true if storing \a size more bytes for \a bareJid would
+/// exceed its offline storage quota.
+
+bool XmppServerArchivePrivate::offlineQuotaReached(const QString &bareJid, int size) const
+{
+    if (offlineMaxCount <= 0 && offlineMaxSize <= 0)
+        return false;
+
+    QSqlQuery query(QDjango::database());
+    query.prepare("SELECT COUNT(*), SUM(LENGTH(data) + COALESCE(LENGTH(compressed), 0)) FROM offlinemessage WHERE jid = ?");
+    query.addBindValue(bareJid);
+    if (!query.exec() || !query.next())
+        return false;
+
+    return (offlineMaxCount > 0 && query.value(0).toInt() >= offlineMaxCount) ||
+           (offlineMaxSize > 0 && query.value(1).toLongLong() + size > offlineMaxSize);
 }
 
 XmppServerArchive::XmppServerArchive()
+    : d(new XmppServerArchivePrivate(this))
 {
+    bool check;
+    Q_UNUSED(check);
+
+    d->compression = false;
+    d->offlineExpiry = 30 * 24 * 3600;
+    d->offlineMaxCount = 1000;
+    d->offlineMaxSize = 1024 * 1024;
+    d->purgeCount = 0;
+    d->retention = 0;
+    d->retentionCount = 0;
+    d->fts5 = false;
+
+    d->purgeTimer = new QTimer(this);
+    d->purgeTimer->setInterval(60000);
+    check = connect(d->purgeTimer, SIGNAL(timeout()),
+                    this, SLOT(_q_purgeOffline()));
+    Q_ASSERT(check);
+
+    d->retentionTimer = new QTimer(this);
+    d->retentionTimer->setInterval(3600000);
+    check = connect(d->retentionTimer, SIGNAL(timeout()),
+                    this, SLOT(_q_applyRetention()));
+    Q_ASSERT(check);
+
     QDjango::registerModel<ArchiveChat>();
     QDjango::registerModel<ArchiveMessage>();
     QDjango::registerModel<OfflineMessage>();
+
+    // use SQLite's full text search if it is available, otherwise
+    // fall back to our own inverted index
+    QSqlDatabase db = QDjango::database();
+    const QStringList tables = db.tables();
+    QSqlQuery query(db);
+    if (db.driverName() == QLatin1String("QSQLITE")) {
+        d->fts5 = tables.contains("archivemessage_search") ||
+                  query.exec("CREATE VIRTUAL TABLE archivemessage_search USING fts5(body, owner)");
+    }
+    if (!d->fts5)
+        QDjango::registerModel<ArchiveTerm>();
     QDjango::createTables();
+
+    // composite indexes for date range queries, these fail harmlessly
+    // if the indexes already exist
+    query.exec("CREATE INDEX archivechat_jid_start ON archivechat (jid, start)");
+    query.exec("CREATE INDEX archivemessage_chat_date ON archivemessage (chat_id, date)");
+    query.exec("CREATE INDEX archivemessage_date ON archivemessage (date)");
+    query.exec("CREATE INDEX offlinemessage_stamp ON offlinemessage (stamp)");
+    if (!d->fts5)
+        query.exec("CREATE INDEX archiveterm_jid_term ON archiveterm (jid, term, message_id)");
+
+    // columns which were added to existing tables, these fail harmlessly
+    // if the columns already exist
+    query.exec("ALTER TABLE archivemessage ADD COLUMN compressed BLOB");
+    query.exec("ALTER TABLE offlinemessage ADD COLUMN compressed BLOB");
+
+    // the messages which were archived before the index existed are
+    // indexed in batches once the server is running
+    if (tables.contains("archivemessage") &&
+        !tables.contains(d->fts5 ? "archivemessage_search" : "archiveterm") &&
+        query.exec("SELECT MAX(id) FROM archivemessage") && query.next())
+        d->rebuildTo = query.value(0).toInt();
+}
+
+XmppServerArchive::~XmppServerArchive()
+{
+    delete d;
+}
+
+/// Returns true if archived bodies and offline messages are compressed.
+///
+
+bool XmppServerArchive::compression() const
+{
+    return d->compression;
+}
+
+/// Enables or disables compression of archived bodies and offline
+/// messages. They are compressed using deflate with a preset dictionary
+/// of common stanza fragments, and stored as binary data.
+///
+/// Stored data is decompressed when it is retrieved, whatever the current
+/// setting.
+///
+/// Defaults to false.
+///
+/// \param compression
+
+void XmppServerArchive::setCompression(bool compression)
+{
+    d->compression = compression;
+}
+
+/// Returns the number of seconds after which offline messages expire.
+///
+
+int XmppServerArchive::offlineExpiry() const
+{
+    return d->offlineExpiry;
+}
+
+/// Sets the number of seconds after which offline messages expire.
+///
+/// If set to 0, offline messages never expire. Defaults to 30 days.
+///
+/// \param expiry
+
+void XmppServerArchive::setOfflineExpiry(int expiry)
+{
+    d->offlineExpiry = expiry;
+}
+
+/// Returns the maximum number of offline messages stored per account.
+///
+
+int XmppServerArchive::offlineMaxCount() const
+{
+    return d->offlineMaxCount;
+}
+
+/// Sets the maximum number of offline messages stored per account.
+///
+/// If set to 0, the number of messages is not limited. Defaults to 1000.
+///
+/// \param count
+
+void XmppServerArchive::setOfflineMaxCount(int count)
+{
+    d->offlineMaxCount = count;
+}
+
+/// Returns the maximum size in bytes of offline messages stored per account.
+///
+
+int XmppServerArchive::offlineMaxSize() const
+{
+    return d->offlineMaxSize;
+}
+
+/// Sets the maximum size in bytes of offline messages stored per account.
+///
+/// If set to 0, the size of messages is not limited. Defaults to 1MB.
+///
+/// \param size
+
+void XmppServerArchive::setOfflineMaxSize(int size)
+{
+    d->offlineMaxSize = size;
+}
+
+/// Returns the number of months for which archived messages are kept.
+///
+
+int XmppServerArchive::retention() const
+{
+    return d->retention;
+}
+
+/// Sets the number of months for which archived messages are kept, in
+/// addition to the current month.
+///
+/// Expired messages are removed in batches according to their own date,
+/// and a collection is removed once it no longer holds any messages.
+///
+/// If set to 0, archived messages are kept forever, which is the default.
+///
+/// \param months
+
+void XmppServerArchive::setRetention(int months)
+{
+    d->retention = months;
 }
 
 QStringList XmppServerArchive::discoveryFeatures() const
 {
-    return QStringList() << ns_archive;
+    return QStringList() << ns_archive << ns_mam2 << ns_fulltext0;
 }
 
 bool XmppServerArchive::handleStanza(const QDomElement &element)
@@ -233,42 +1365,70 @@ bool XmppServerArchive::handleStanza(const QDomElement &element)
         QXmppMessage message;
         message.parse(element);
 
-        if (QXmppUtils::jidToDomain(from) == domain)
-            saveMessage(message, now, false);
-
+        // check whether the recipient is offline
+        bool offline = false;
         if (QXmppUtils::jidToDomain(to) == domain) {
-            saveMessage(message, now, true);
-
-            // offline messages
-            bool found = false;
-
+            offline = true;
             XmppServerPresence *presenceExtension = XmppServerPresence::instance(server());
             Q_ASSERT(presenceExtension);
             foreach (const QXmppPresence &presence, presenceExtension->availablePresences(QXmppUtils::jidToBareJid(to))) {
                 if (QXmppUtils::jidToResource(to).isEmpty() || presence.from() == to) {
-                    found = true;
+                    offline = false;
                     break;
                 }
             }
-            if (!found) {
-                message.setStamp(now);
-                message.setState(QXmppMessage::None);
-                message.setTo(QXmppUtils::jidToBareJid(to));
-
-                QBuffer buffer;
-                buffer.open(QIODevice::WriteOnly);
-                QXmlStreamWriter writer(&buffer);
-                message.toXml(&writer);
-
-                OfflineMessage offline;
-                offline.setData(QString::fromUtf8(buffer.data()));
-                offline.setJid(QXmppUtils::jidToBareJid(to));
-                offline.setStamp(now);
-                offline.save();
+        }
+
+        // offline messages
+        QString data;
+        QByteArray compressed;
+        if (offline) {
+            QXmppMessage copy = message;
+            copy.setStamp(now);
+            copy.setState(QXmppMessage::None);
+            copy.setTo(QXmppUtils::jidToBareJid(to));
+
+            QBuffer buffer;
+            buffer.open(QIODevice::WriteOnly);
+            QXmlStreamWriter writer(&buffer);
+            copy.toXml(&writer);
+            data = QString::fromUtf8(buffer.data());
+            compressed = d->encode(data);
+
+            // bounce the message if the recipient's storage is full, it
+            // is not archived either as it was not delivered
+            if (d->offlineQuotaReached(QXmppUtils::jidToBareJid(to), compressed.isEmpty() ? buffer.data().size() : compressed.size())) {
+                QXmppMessage bounce;
+                bounce.setId(element.attribute("id"));
+                bounce.setFrom(to);
+                bounce.setTo(from);
+                bounce.setType(QXmppMessage::Error);
+                bounce.setError(QXmppStanza::Error(
+                    QXmppStanza::Error::Cancel,
+                    QXmppStanza::Error::ServiceUnavailable));
+                server()->sendPacket(bounce);
+                updateCounter("archive.offline.bounced");
                 return true;
             }
         }
 
+        if (QXmppUtils::jidToDomain(from) == domain)
+            d->saveMessage(message, now, false);
+
+        if (QXmppUtils::jidToDomain(to) == domain)
+            d->saveMessage(message, now, true);
+
+        if (offline) {
+            OfflineMessage stored;
+            stored.setCompressed(compressed);
+            stored.setData(compressed.isEmpty() ? data : QString());
+            stored.setJid(QXmppUtils::jidToBareJid(to));
+            stored.setStamp(now);
+            stored.save();
+            updateCounter("archive.offline.stored");
+            return true;
+        }
+
         return false;
 
     } else if (element.tagName() == "presence" &&
@@ -283,17 +1443,12 @@ bool XmppServerArchive::handleStanza(const QDomElement &element)
                 return false;
         }
 
-        // send offline messages
-        QDjangoQuerySet<OfflineMessage> qs;
-        OfflineMessage offline;
-        qs = qs.filter(QDjangoWhere("jid", QDjangoWhere::Equals, QXmppUtils::jidToBareJid(from)));
-        for (int i = 0; i < qs.size(); ++i) {
-            if (qs.at(i, &offline)) {
-                QDomDocument doc;
-                doc.setContent(offline.data());
-                if (server()->sendElement(doc.documentElement()))
-                    offline.remove();
-            }
+        // schedule delivery of offline messages
+        const QString bareFrom = QXmppUtils::jidToBareJid(from);
+        if (!d->offlineQueue.contains(bareFrom)) {
+            d->offlineQueue << bareFrom;
+            if (d->offlineQueue.size() == 1)
+                QMetaObject::invokeMethod(this, "_q_deliverOffline", Qt::QueuedConnection);
         }
 
     } else if (element.tagName() == "iq" &&
@@ -356,20 +1511,15 @@ bool XmppServerArchive::handleStanza(const QDomElement &element)
             if (request.end().isValid())
                 qs = qs.filter(QDjangoWhere("start", QDjangoWhere::LessOrEquals, request.end()));
 
-            if (qs.size() > 0) {
-                // collect deleted collection ids
-                QList<QVariant> chatIds;
-                foreach (const QList<QVariant> &values, qs.valuesList(QStringList() << "id"))
-                    chatIds << values[0];
+            // remove collections in bounded batches
+            int removed;
+            int total = 0;
+            while ((removed = d->removeCollections(qs, collectionBatchSize)) > 0)
+                total += removed;
 
-                // filter deleted items
-                QDjangoQuerySet<ArchiveMessage> deleted_msgs;
-                deleted_msgs = deleted_msgs.filter(QDjangoWhere("chat_id", QDjangoWhere::IsIn, chatIds));
-
-                // remove messages and collections
-                if (!deleted_msgs.remove() || !qs.remove())
-                    response.setType(QXmppIq::Error);
-            } else {
+            if (removed < 0) {
+                response.setType(QXmppIq::Error);
+            } else if (!total) {
                 // not found
                 response.setType(QXmppIq::Error);
                 response.setError(QXmppStanza::Error(
@@ -383,6 +1533,80 @@ bool XmppServerArchive::handleStanza(const QDomElement &element)
         server()->sendPacket(response);
         return true;
 
+    } else if (element.tagName() == "iq" &&
+               (to.isEmpty() || to == domain || to == QXmppUtils::jidToBareJid(from)) &&
+               MamQueryIq::isMamQueryIq(element)) {
+
+        MamQueryIq request;
+        request.parse(element);
+
+        MamQueryIq response;
+        response.setTo(request.from());
+        response.setId(request.id());
+        response.setType(QXmppIq::Result);
+
+        if (request.type() == QXmppIq::Get || request.type() == QXmppIq::Set) {
+            const QXmppResultSetQuery rsmQuery = request.resultSetQuery();
+            const QString bareFrom = QXmppUtils::jidToBareJid(request.from());
+
+            QDjangoQuerySet<ArchiveMessage> qs;
+            qs = qs.filter(QDjangoWhere("chat__jid", QDjangoWhere::Equals, bareFrom));
+            if (!request.with().isEmpty())
+                qs = qs.filter(QDjangoWhere("chat__with", QDjangoWhere::Equals, QXmppUtils::jidToBareJid(request.with())));
+            if (request.start().isValid())
+                qs = qs.filter(QDjangoWhere("date", QDjangoWhere::GreaterOrEquals, request.start()));
+            if (request.end().isValid())
+                qs = qs.filter(QDjangoWhere("date", QDjangoWhere::LessOrEquals, request.end()));
+
+            // the paging IDs must refer to messages in this archive
+            const ArchivePosition after = d->messagePosition(bareFrom, rsmQuery.after());
+            const ArchivePosition before = d->messagePosition(bareFrom, rsmQuery.before());
+            const bool knownIds = (rsmQuery.after().isEmpty() || !after.isNull()) &&
+                                  (rsmQuery.before().isEmpty() || !before.isNull());
+
+            QXmppResultSetReply rsmReply;
+            if (!knownIds) {
+                response.setType(QXmppIq::Error);
+                response.setError(QXmppStanza::Error(
+                    QXmppStanza::Error::Cancel,
+                    QXmppStanza::Error::ItemNotFound));
+            } else if (rsmQuery.max() == 0) {
+                // only the count was requested
+                rsmReply.setCount(d->countMessages(qs, bareFrom, request.fullText()));
+                response.setComplete(true);
+            } else {
+                // fetch one extra message to find out whether this is the last page
+                const int max = (rsmQuery.max() < 0 || rsmQuery.max() > mamMaxResults) ? mamMaxResults : rsmQuery.max();
+                QList<ArchiveMessage*> messages = d->fetchMessages(qs, bareFrom, request.fullText(), after, before, !rsmQuery.before().isNull(), max + 1);
+                response.setComplete(messages.size() <= max);
+                if (messages.size() > max)
+                    delete messages.takeLast();
+                if (!rsmQuery.before().isNull()) {
+                    for (int i = 0; i < messages.size() / 2; ++i)
+                        messages.swap(i, messages.size() - 1 - i);
+                }
+                if (!messages.isEmpty()) {
+                    rsmReply.setFirst(messages.first()->pk().toString());
+                    rsmReply.setLast(messages.last()->pk().toString());
+                }
+
+                // stream results
+                foreach (ArchiveMessage *message, messages) {
+                    message->setBody(d->decode(message->body(), message->compressed()));
+                    server()->sendPacket(MamResultMessage(request.from(), request.queryId(), *message));
+                }
+                qDeleteAll(messages);
+            }
+            response.setResultSetReply(rsmReply);
+        } else {
+            response.setType(QXmppIq::Error);
+            response.setError(QXmppStanza::Error(
+                QXmppStanza::Error::Cancel,
+                QXmppStanza::Error::BadRequest));
+        }
+        server()->sendPacket(response);
+        return true;
+
     } else if (element.tagName() == "iq" &&
                to == server()->domain() &&
                QXmppArchiveRetrieveIq::isArchiveRetrieveIq(element)) {
@@ -408,9 +1632,16 @@ bool XmppServerArchive::handleStanza(const QDomElement &element)
                 qs = qs.filter(QDjangoWhere("chat_id", QDjangoWhere::Equals, chat.pk()));
                 qs = qs.orderBy(QStringList() << "date");
 
-                QList<QXmppArchiveMessage> messages;
+                QList<PackedArchiveMessage> packedMessages;
                 QXmppResultSetReply rsmReply;
-                rsmFilter(qs, rsmQuery, messages, rsmReply);
+                rsmFilter(qs, rsmQuery, packedMessages, rsmReply);
+
+                // only the retrieved page is decompressed
+                QList<QXmppArchiveMessage> messages;
+                foreach (PackedArchiveMessage message, packedMessages) {
+                    message.setBody(d->decode(message.body(), message.compressed));
+                    messages << message;
+                }
 
                 // FIXME: this is a hack for clients using QXmpp < 0.4.93
                 if (element.firstChildElement("retrieve").firstChildElement().isNull() && messages.size() > 2) {
@@ -440,6 +1671,163 @@ bool XmppServerArchive::handleStanza(const QDomElement &element)
     return false;
 }
 
+/// Delivers a chunk of offline messages for the first JID in the queue,
+/// then yields to the event loop.
+
+void XmppServerArchive::_q_deliverOffline()
+{
+    if (d->offlineQueue.isEmpty())
+        return;
+    const QString bareJid = d->offlineQueue.takeFirst();
+
+    QDjangoQuerySet<OfflineMessage> qs;
+    qs = qs.filter(QDjangoWhere("jid", QDjangoWhere::Equals, bareJid));
+    if (d->offlineExpiry > 0) {
+        const QDateTime cutoff = QDateTime::currentDateTime().toUTC().addSecs(-d->offlineExpiry);
+        qs = qs.filter(QDjangoWhere("stamp", QDjangoWhere::GreaterOrEquals, cutoff));
+    }
+    qs = qs.orderBy(QStringList() << "id").limit(0, offlineChunkSize);
+
+    // send the stored stanzas without parsing them
+    QList<QVariant> deliveredIds;
+    bool failed = false;
+    foreach (const QList<QVariant> &values, qs.valuesList(QStringList() << "id" << "data" << "compressed")) {
+        if (!server()->sendPacket(SerializedStanza(bareJid, d->decode(values[1].toString(), values[2].toByteArray()).toUtf8()))) {
+            failed = true;
+            break;
+        }
+        deliveredIds << values[0];
+    }
+
+    // remove delivered messages
+    if (!deliveredIds.isEmpty()) {
+        QDjangoQuerySet<OfflineMessage> delivered;
+        delivered = delivered.filter(QDjangoWhere("id", QDjangoWhere::IsIn, deliveredIds));
+        if (!delivered.remove())
+            warning(QString("Could not remove offline messages for %1").arg(bareJid));
+    }
+
+    // if the chunk was full, there may be more messages
+    if (!failed && deliveredIds.size() == offlineChunkSize)
+        d->offlineQueue << bareJid;
+
+    if (!d->offlineQueue.isEmpty())
+        QMetaObject::invokeMethod(this, "_q_deliverOffline", Qt::QueuedConnection);
+}
+
+/// Removes a batch of expired offline messages. If more messages need to be
+/// removed, the purge continues after yielding to the event loop.
+
+void XmppServerArchive::_q_purgeOffline()
+{
+    const QDateTime cutoff = QDateTime::currentDateTime().toUTC().addSecs(-d->offlineExpiry);
+
+    QDjangoQuerySet<OfflineMessage> qs;
+    qs = qs.filter(QDjangoWhere("stamp", QDjangoWhere::LessThan, cutoff));
+    const int removed = removeBatch(qs, purgeBatchSize);
+    if (removed < 0) {
+        warning("Could not purge expired offline messages");
+    } else if (removed > 0) {
+        d->purgeCount += removed;
+        updateCounter("archive.offline.purged", removed);
+        if (removed == purgeBatchSize) {
+            QMetaObject::invokeMethod(this, "_q_purgeOffline", Qt::QueuedConnection);
+            return;
+        }
+    }
+
+    // purge is complete
+    if (d->purgeCount > 0) {
+        info(QString("Purged %1 expired offline messages").arg(d->purgeCount));
+        d->purgeCount = 0;
+    }
+    setGauge("archive.offline.count", QDjangoQuerySet<OfflineMessage>().count());
+}
+
+/// Removes a batch of messages dated in a month which is past the retention
+/// period, then the collections they leave empty. If more rows need to be
+/// removed, this continues after yielding to the event loop.
+
+void XmppServerArchive::_q_applyRetention()
+{
+    const QDate today = QDateTime::currentDateTime().toUTC().date();
+    const QDateTime cutoff(QDate(today.year(), today.month(), 1).addMonths(-d->retention), QTime(0, 0), Qt::UTC);
+
+    QDjangoQuerySet<ArchiveMessage> qs;
+    qs = qs.filter(QDjangoWhere("date", QDjangoWhere::LessThan, cutoff));
+    int removed = d->removeMessages(qs, retentionBatchSize);
+    if (removed < 0) {
+        warning("Could not remove expired archive messages");
+    } else if (removed > 0) {
+        d->retentionCount += removed;
+        updateCounter("archive.message.expired", removed);
+        if (removed == retentionBatchSize) {
+            QMetaObject::invokeMethod(this, "_q_applyRetention", Qt::QueuedConnection);
+            return;
+        }
+    }
+
+    // collections which started before the cutoff may still hold recent
+    // messages, so only the empty ones are removed
+    removed = d->removeEmptyCollections(cutoff, collectionBatchSize);
+    if (removed < 0) {
+        warning("Could not remove expired archive collections");
+    } else if (removed > 0) {
+        updateCounter("archive.collection.expired", removed);
+        if (removed == collectionBatchSize) {
+            QMetaObject::invokeMethod(this, "_q_applyRetention", Qt::QueuedConnection);
+            return;
+        }
+    }
+
+    if (d->retentionCount > 0) {
+        info(QString("Removed %1 archived messages older than %2").arg(
+            QString::number(d->retentionCount),
+            cutoff.date().toString(Qt::ISODate)));
+        d->retentionCount = 0;
+    }
+}
+
+/// Adds a batch of messages which were archived before the search index
+/// existed to the index. If more messages need to be indexed, this
+/// continues after yielding to the event loop.
+
+void XmppServerArchive::_q_rebuildIndex()
+{
+    const int lastId = d->rebuildIndex(d->rebuildFrom, rebuildBatchSize);
+    if (lastId < 0) {
+        warning("Could not index archived messages");
+    } else if (lastId > d->rebuildFrom && lastId < d->rebuildTo) {
+        d->rebuildFrom = lastId;
+        QMetaObject::invokeMethod(this, "_q_rebuildIndex", Qt::QueuedConnection);
+        return;
+    } else {
+        info("Finished indexing archived messages");
+    }
+    d->rebuildFrom = d->rebuildTo;
+}
+
+bool XmppServerArchive::start()
+{
+    if (d->rebuildFrom < d->rebuildTo) {
+        info("Indexing archived messages");
+        QMetaObject::invokeMethod(this, "_q_rebuildIndex", Qt::QueuedConnection);
+    }
+    if (d->offlineExpiry > 0)
+        d->purgeTimer->start();
+    if (d->retention > 0) {
+        d->retentionTimer->start();
+        QMetaObject::invokeMethod(this, "_q_applyRetention", Qt::QueuedConnection);
+    }
+    return true;
+}
+
+void XmppServerArchive::stop()
+{
+    d->purgeTimer->stop();
+    d->retentionTimer->stop();
+}
+
 // PLUGIN
 
 class XmppServerArchivePlugin : public QXmppServerPlugin
@@ -24,6 +24,8 @@
 #include "QXmppArchiveIq.h"
 #include "QXmppServerExtension.h"
 
+class XmppServerArchivePrivate;
+
 class ArchiveChat : public QDjangoModel, public QXmppArchiveChat
 {
     Q_OBJECT
@@ -57,29 +59,71 @@ class ArchiveMessage : public QDjangoModel, public QXmppArchiveMessage
     Q_OBJECT
     Q_PROPERTY(ArchiveChat* chat READ chat WRITE setChat);
     Q_PROPERTY(QString body READ body WRITE setBody)
+    Q_PROPERTY(QByteArray compressed READ compressed WRITE setCompressed)
     Q_PROPERTY(QDateTime date READ date WRITE setDate)
     Q_PROPERTY(bool received READ isReceived WRITE setReceived)
 
+    Q_CLASSINFO("compressed", "null=true")
+
 public:
-    ArchiveMessage();
+    ArchiveMessage(QObject *parent = 0);
 
     ArchiveChat *chat() const;
     void setChat(ArchiveChat *chat);
 
+    QByteArray compressed() const;
+    void setCompressed(const QByteArray &compressed);
+
 private:
     int m_chatId;
+    QByteArray m_compressed;
+};
+
+/// A search term occurring in an archived message, used for full text
+/// search when the database has no native support for it.
+
+class ArchiveTerm : public QDjangoModel
+{
+    Q_OBJECT
+    Q_PROPERTY(QString jid READ jid WRITE setJid)
+    Q_PROPERTY(ArchiveMessage* message READ message WRITE setMessage)
+    Q_PROPERTY(QString term READ term WRITE setTerm)
+
+    Q_CLASSINFO("jid", "max_length=255")
+    Q_CLASSINFO("term", "max_length=64")
+
+public:
+    ArchiveTerm(QObject *parent = 0);
+
+    QString jid() const;
+    void setJid(const QString &jid);
+
+    ArchiveMessage *message() const;
+    void setMessage(ArchiveMessage *message);
+
+    QString term() const;
+    void setTerm(const QString &term);
+
+private:
+    QString m_jid;
+    QString m_term;
 };
 
 class OfflineMessage : public QDjangoModel
 {
     Q_OBJECT
     Q_PROPERTY(QString jid READ jid WRITE setJid)
+    Q_PROPERTY(QByteArray compressed READ compressed WRITE setCompressed)
     Q_PROPERTY(QString data READ data WRITE setData)
     Q_PROPERTY(QDateTime stamp READ stamp WRITE setStamp)
 
+    Q_CLASSINFO("compressed", "null=true")
     Q_CLASSINFO("jid", "max_length=255 db_index=true")
 
 public:
+    QByteArray compressed() const;
+    void setCompressed(const QByteArray &compressed);
+
     QString data() const;
     void setData(const QString &data);
 
@@ -90,22 +134,62 @@ public:
     void setStamp(const QDateTime &stamp);
 
 private:
+    QByteArray m_compressed;
     QString m_jid;
     QString m_data;
     QDateTime m_stamp;
 };
 
-/// \brief QXmppServer extension for XEP-0136: Message Archiving.
+/// \brief QXmppServer extension for XEP-0136: Message Archiving and
+/// XEP-0313: Message Archive Management.
+///
+/// Archived messages can be searched using XEP-0431: Full Text Search in MAM.
 ///
 class XmppServerArchive : public QXmppServerExtension
 {
     Q_OBJECT
     Q_CLASSINFO("ExtensionName", "archive");
+    Q_PROPERTY(bool compression READ compression WRITE setCompression);
+    Q_PROPERTY(int offlineExpiry READ offlineExpiry WRITE setOfflineExpiry);
+    Q_PROPERTY(int offlineMaxCount READ offlineMaxCount WRITE setOfflineMaxCount);
+    Q_PROPERTY(int offlineMaxSize READ offlineMaxSize WRITE setOfflineMaxSize);
+    Q_PROPERTY(int retention READ retention WRITE setRetention);
 
 public:
     XmppServerArchive();
+    ~XmppServerArchive();
+
+    bool compression() const;
+    void setCompression(bool compression);
+
+    int offlineExpiry() const;
+    void setOfflineExpiry(int expiry);
+
+    int offlineMaxCount() const;
+    void setOfflineMaxCount(int count);
+
+    int offlineMaxSize() const;
+    void setOfflineMaxSize(int size);
+
+    int retention() const;
+    void setRetention(int months);
+
+    /// \cond
     QStringList discoveryFeatures() const;
     bool handleStanza(const QDomElement &element);
+    bool start();
+    void stop();
+    /// \endcond
+
+private slots:
+    void _q_deliverOffline();
+    void _q_applyRetention();
+    void _q_purgeOffline();
+    void _q_rebuildIndex();
+
+private:
+    XmppServerArchivePrivate * const d;
+    friend class XmppServerArchivePrivate;
 };
 
 #endif
@@ -20,11 +20,20 @@
 #include <QAuthenticator>
 #include <QCoreApplication>
 #include <QCryptographicHash>
+#include <QDataStream>
 #include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QFileSystemWatcher>
 #include <QNetworkAccessManager>
 #include <QNetworkReply>
 #include <QNetworkRequest>
+#include <QPointer>
+#include <QQueue>
 #include <QSettings>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QThread>
 #include <QTimer>
 #include <QUrl>
 
@@ -36,107 +45,792 @@
 
 #include "mod_auth.h"
 
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+// identifies a cache snapshot file
+static const quint32 cacheFileMagic = 0x41434331;
+
+// number of consecutive failures after which the HTTP backend is suspended
+static const int httpFailureThreshold = 5;
+
+// number of seconds for which the HTTP backend is suspended
+static const int httpRetryDelay = 30;
+
 enum Backend {
     FileBackend,
     HttpBackend,
     SqlBackend,
 };
 
+/** A size-bounded cache of values which expire after a given time.
+ *
+ *  When the cache is full, the least recently used entry is evicted.
+ */
 class Cache
 {
 public:
     Cache();
     ~Cache();
 
-    QString get(const QString &key) const;
-    bool set(const QString &key, const QString &value, int expiration = 0);
+    int maxSize() const;
+    void setMaxSize(int maxSize);
+    int size() const;
+
+    int staleTime() const;
+    void setStaleTime(int staleTime);
+
+    QString get(const QString &key, bool allowStale = false);
+    void insert(const QString &key, const QString &value, int ttl);
+    void clear();
+    void remove(const QString &key);
+
+    int expire();
+    int takeEvictions();
+
+    void load(QDataStream &stream);
+    void save(QDataStream &stream) const;
 
 private:
-    QHash<QString, QPair<QString, QDateTime> > m_values;
+    struct Entry {
+        QString key;
+        QString value;
+        qint64 expires;
+        Entry *previous;
+        Entry *next;
+    };
+    void link(Entry *entry);
+    void unlink(Entry *entry);
+    void removeEntry(Entry *entry);
+    Q_DISABLE_COPY(Cache)
+
+    QHash<QString, Entry*> m_entries;
+    // most recently used first
+    Entry *m_first;
+    Entry *m_last;
+    int m_evictions;
+    int m_maxSize;
+    int m_staleTime;
 };
 
 Cache::Cache()
+    : m_first(0)
+    , m_last(0)
+    , m_evictions(0)
+    , m_maxSize(0)
+    , m_staleTime(0)
 {
 }
 
 Cache::~Cache()
 {
+    qDeleteAll(m_entries);
+}
+
+/** Returns the maximum number of entries in the cache.
+ */
+int Cache::maxSize() const
+{
+    return m_maxSize;
 }
 
-QString Cache::get(const QString &key) const
+/** Sets the maximum number of entries in the cache.
+ *
+ * @param maxSize
+ */
+void Cache::setMaxSize(int maxSize)
 {
-    if (m_values.contains(key)) {
-        QPair<QString, QDateTime> entry = m_values.value(key);
-        if (entry.second > QDateTime::currentDateTime()) {
-            qDebug("Cache hit for '%s'", qPrintable(key));
-            return entry.first;
-        }
+    m_maxSize = qMax(0, maxSize);
+    while (m_entries.size() > m_maxSize) {
+        removeEntry(m_last);
+        m_evictions++;
     }
+}
 
-    qDebug("Cache miss for '%s'", qPrintable(key));
-    return QString();
+/** Returns the number of entries in the cache.
+ */
+int Cache::size() const
+{
+    return m_entries.size();
 }
 
-bool Cache::set(const QString &key, const QString &value, int expiration)
+/** Returns the number of seconds for which expired entries are kept
+ *  so they can be used as a fallback.
+ */
+int Cache::staleTime() const
 {
-    qDebug("Cache set for '%s'", qPrintable(key));
+    return m_staleTime;
+}
 
-    if (key.isEmpty()) {
-        return false;
+/** Sets the number of seconds for which expired entries are kept
+ *  so they can be used as a fallback.
+ *
+ * @param staleTime
+ */
+void Cache::setStaleTime(int staleTime)
+{
+    m_staleTime = qMax(0, staleTime);
+}
+
+/** Returns the value for the given \a key, or a null string if there is
+ *  no such entry or it has expired.
+ *
+ *  If \a allowStale is true, entries which expired less than staleTime()
+ *  seconds ago are also returned.
+ */
+QString Cache::get(const QString &key, bool allowStale)
+{
+    Entry *entry = m_entries.value(key);
+    if (!entry)
+        return QString();
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (entry->expires + qint64(m_staleTime) * 1000 <= now) {
+        removeEntry(entry);
+        return QString();
+    } else if (entry->expires <= now && !allowStale) {
+        return QString();
+    }
+
+    // mark the entry as most recently used
+    unlink(entry);
+    link(entry);
+    return entry->value;
+}
+
+/** Stores \a value for the given \a key for \a ttl seconds.
+ */
+void Cache::insert(const QString &key, const QString &value, int ttl)
+{
+    if (key.isEmpty() || ttl <= 0 || !m_maxSize)
+        return;
+
+    Entry *entry = m_entries.value(key);
+    if (entry) {
+        unlink(entry);
     } else {
-        QPair<QString, QDateTime> entry;
-        entry.first = value;
-        if (expiration > 0)
-            entry.second = QDateTime::currentDateTime().addSecs(expiration);
-        m_values.insert(key, entry);
-        return true;
+        if (m_entries.size() >= m_maxSize) {
+            removeEntry(m_last);
+            m_evictions++;
+        }
+        entry = new Entry;
+        entry->key = key;
+        m_entries.insert(key, entry);
     }
+    entry->value = value;
+    entry->expires = QDateTime::currentMSecsSinceEpoch() + qint64(ttl) * 1000;
+    link(entry);
 }
 
-HttpPasswordReply::HttpPasswordReply(QNetworkReply *reply)
-    : m_networkReply(reply)
+/** Removes all the entries.
+ */
+void Cache::clear()
 {
-    connect(m_networkReply, SIGNAL(finished()),
-            this, SLOT(onFinished()));
+    qDeleteAll(m_entries);
+    m_entries.clear();
+    m_first = 0;
+    m_last = 0;
 }
 
-void HttpPasswordReply::onFinished()
+/** Removes the entry for the given \a key.
+ */
+void Cache::remove(const QString &key)
 {
-    if (m_networkReply->error() == QNetworkReply::NoError) {
-        setDigest(QByteArray::fromHex(m_networkReply->readAll()));
-    } else if (m_networkReply->error() == QNetworkReply::ContentNotFoundError) {
-        setError(QXmppPasswordReply::AuthorizationError);
-    } else {
-        setError(QXmppPasswordReply::TemporaryError);
+    Entry *entry = m_entries.value(key);
+    if (entry)
+        removeEntry(entry);
+}
+
+/** Removes entries which are past their stale time and returns
+ *  their number.
+ */
+int Cache::expire()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch() - qint64(m_staleTime) * 1000;
+    int expired = 0;
+    Entry *entry = m_first;
+    while (entry) {
+        Entry *next = entry->next;
+        if (entry->expires <= now) {
+            removeEntry(entry);
+            expired++;
+        }
+        entry = next;
+    }
+    return expired;
+}
+
+/** Returns the number of entries evicted to make space since the
+ *  last call.
+ */
+int Cache::takeEvictions()
+{
+    const int evictions = m_evictions;
+    m_evictions = 0;
+    return evictions;
+}
+
+/** Loads entries from a snapshot written by save(), skipping those
+ *  which are past their stale time.
+ */
+void Cache::load(QDataStream &stream)
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    const qint64 staleTime = qint64(m_staleTime) * 1000;
+
+    quint32 count;
+    stream >> count;
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+        QString key, value;
+        qint64 expires;
+        stream >> key >> value >> expires;
+        if (stream.status() != QDataStream::Ok || expires + staleTime <= now)
+            continue;
+
+        const int ttl = int(qMax(qint64(1), (expires - now + 999) / 1000));
+        insert(key, value, ttl);
+        Entry *entry = m_entries.value(key);
+        if (entry)
+            entry->expires = expires;
+    }
+}
+
+/** Writes the entries to a snapshot, from least to most recently used so
+ *  that load() restores their order. Expiry times are absolute.
+ */
+void Cache::save(QDataStream &stream) const
+{
+    stream << quint32(m_entries.size());
+    for (Entry *entry = m_last; entry; entry = entry->previous)
+        stream << entry->key << entry->value << entry->expires;
+}
+
+void Cache::link(Entry *entry)
+{
+    entry->previous = 0;
+    entry->next = m_first;
+    if (m_first)
+        m_first->previous = entry;
+    m_first = entry;
+    if (!m_last)
+        m_last = entry;
+}
+
+void Cache::unlink(Entry *entry)
+{
+    if (entry->previous)
+        entry->previous->next = entry->next;
+    else
+        m_first = entry->next;
+    if (entry->next)
+        entry->next->previous = entry->previous;
+    else
+        m_last = entry->previous;
+}
+
+void Cache::removeEntry(Entry *entry)
+{
+    unlink(entry);
+    m_entries.remove(entry->key);
+    delete entry;
+}
+
+/** Adds a connection to the MySQL or SQLite database described by \a url.
+ *
+ *  For MySQL, connecting, reading and writing give up after \a timeout
+ *  seconds, so that a worker cannot be stuck on a dead server.
+ */
+static QSqlDatabase addSqlDatabase(const QString &connectionName, const QUrl &url, const QString &user, const QString &password, int timeout)
+{
+    if (url.scheme() == "sqlite") {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", connectionName);
+        db.setDatabaseName(url.path());
+        return db;
+    }
+
+    QSqlDatabase db = QSqlDatabase::addDatabase("QMYSQL", connectionName);
+    db.setConnectOptions(QString("MYSQL_OPT_RECONNECT=1;MYSQL_OPT_CONNECT_TIMEOUT=%1;"
+                                 "MYSQL_OPT_READ_TIMEOUT=%1;MYSQL_OPT_WRITE_TIMEOUT=%1").arg(qMax(1, timeout)));
+    db.setDatabaseName(url.path().mid(1));
+    db.setHostName(url.host());
+    db.setUserName(user);
+    db.setPassword(password);
+    return db;
+}
+
+SqlPasswordWorker::SqlPasswordWorker(const QString &connectionName, const QUrl &url, const QString &user, const QString &password, const QString &query, int timeout)
+    : pending(0),
+    m_connectionName(connectionName),
+    m_password(password),
+    m_queryString(query),
+    m_timeout(timeout),
+    m_url(url),
+    m_user(user),
+    m_query(0)
+{
+}
+
+SqlPasswordWorker::~SqlPasswordWorker()
+{
+    if (m_query) {
+        delete m_query;
+        QSqlDatabase::database(m_connectionName, false).close();
+        QSqlDatabase::removeDatabase(m_connectionName);
+    }
+}
+
+/** Looks up the password for \a jid, this runs in the worker's thread.
+ *
+ *  The connection and the prepared statement are set up on first use,
+ *  then reused for subsequent lookups.
+ */
+void SqlPasswordWorker::lookup(int id, const QString &jid)
+{
+    if (!m_query) {
+        QSqlDatabase db = addSqlDatabase(m_connectionName, m_url, m_user, m_password, m_timeout);
+        if (db.open()) {
+            m_query = new QSqlQuery(db);
+            m_query->prepare(m_queryString);
+        } else {
+            emit sqlError(QString("Cannot open SQL database: %1").arg(db.lastError().text()));
+        }
     }
-    m_networkReply->deleteLater();
-    finish();
+    if (!m_query) {
+        QSqlDatabase::removeDatabase(m_connectionName);
+        emit passwordFound(id, QXmppPasswordReply::TemporaryError, QString());
+        return;
+    }
+
+    m_query->addBindValue(jid);
+    if (!m_query->exec()) {
+        emit sqlError(QString("Could not retrieve password from SQL for %1: %2").arg(jid, m_query->lastError().text()));
+        emit passwordFound(id, QXmppPasswordReply::TemporaryError, QString());
+        return;
+    }
+    if (!m_query->next() || m_query->value(0).toString() != jid) {
+        m_query->finish();
+        emit passwordFound(id, QXmppPasswordReply::AuthorizationError, QString());
+        return;
+    }
+    const QString password = m_query->value(1).toString();
+    m_query->finish();
+    emit passwordFound(id, QXmppPasswordReply::NoError, password);
 }
 
+/** A lookup which was handed to an SQL worker.
+ */
+struct SqlLookup
+{
+    bool isDigest;
+    QXmppPasswordRequest request;
+    QPointer<QXmppPasswordReply> reply;
+};
+
+/** A lookup against the HTTP backend, shared by all the requests
+ *  for the same credentials.
+ */
+struct HttpLookup
+{
+    QString key;
+    bool isDigest;
+    QString cacheKey;
+    QString cacheValue;
+    QByteArray data;
+    QList<QPointer<QXmppPasswordReply> > replies;
+};
+
 class XmppPasswordCheckerPrivate
 {
 public:
+    XmppPasswordCheckerPrivate(XmppPasswordChecker *qq);
+    void cacheDigest(const QString &key, QXmppPasswordReply::Error error, const QByteArray &digest);
+    void cachePassword(const QString &key, const QString &hash, QXmppPasswordReply::Error error);
+    QXmppPasswordReply *httpLookup(bool isDigest, const QString &cacheKey, const QString &cacheValue, const QByteArray &data);
+    void finishLookup(HttpLookup *lookup, QXmppPasswordReply::Error error, const QByteArray &digest);
+    bool isBreakerOpen() const;
+    void startLookup(HttpLookup *lookup);
+    void startQueuedLookups();
+    QXmppPasswordReply *sqlLookup(const QXmppPasswordRequest &request, bool isDigest);
+    void loadCache();
+    bool loadPasswords();
+    void saveCache();
+
     Backend backend;
+
+    // successful lookups, and failed ones which are kept for less time
     Cache cache;
+    Cache negativeCache;
+    QTimer *cacheTimer;
+    QString cacheFile;
+    QTimer *cacheSaveTimer;
+    int cachePasswordTtl;
+    int cacheDigestTtl;
+    int cacheNegativeTtl;
+
+    // HTTP lookups by credentials, by network reply and awaiting a slot
+    QHash<QString, HttpLookup*> httpLookups;
+    QHash<QNetworkReply*, HttpLookup*> httpRequests;
+    QQueue<HttpLookup*> httpQueue;
+    int httpMaxQueue;
+    int httpMaxRequests;
+    int httpTimeout;
+    int httpFailures;
+    qint64 httpRetryTime;
+
     QNetworkAccessManager *network;
     QUrl url;
     QString user;
     QString password;
-    QSettings *settings;
-    QSqlDatabase sqlDatabase;
+
+    // passwords from the password file, keyed by "domain/username"
+    QHash<QString, QString> passwords;
+    QFileSystemWatcher *passwordWatcher;
+    QTimer *passwordTimer;
     QString sqlGetQuery;
+
+    // SQL lookups by ID, and the workers performing them
+    QHash<int, SqlLookup> sqlLookups;
+    int sqlLastId;
+    int sqlTimeout;
+    int sqlWorkerCount;
+    QList<SqlPasswordWorker*> sqlWorkers;
+    QList<QThread*> sqlThreads;
+
+private:
+    XmppPasswordChecker *q;
 };
 
+XmppPasswordCheckerPrivate::XmppPasswordCheckerPrivate(XmppPasswordChecker *qq)
+    : httpMaxQueue(1000)
+    , httpMaxRequests(32)
+    , httpTimeout(10)
+    , httpFailures(0)
+    , httpRetryTime(0)
+    , sqlLastId(0)
+    , sqlTimeout(5)
+    , sqlWorkerCount(4)
+    , q(qq)
+{
+}
+
+/** Updates the cache with the result of a digest lookup.
+ */
+void XmppPasswordCheckerPrivate::cacheDigest(const QString &key, QXmppPasswordReply::Error error, const QByteArray &digest)
+{
+    if (error == QXmppPasswordReply::NoError) {
+        cache.insert(key, digest.toHex(), cacheDigestTtl);
+        negativeCache.remove(key);
+    } else if (error == QXmppPasswordReply::AuthorizationError) {
+        negativeCache.insert(key, QLatin1String(""), cacheNegativeTtl);
+    }
+}
+
+/** Updates the cache with the result of a password check.
+ */
+void XmppPasswordCheckerPrivate::cachePassword(const QString &key, const QString &hash, QXmppPasswordReply::Error error)
+{
+    if (error == QXmppPasswordReply::NoError) {
+        cache.insert(key, hash, cachePasswordTtl);
+        negativeCache.remove(key);
+    } else if (error == QXmppPasswordReply::AuthorizationError) {
+        negativeCache.insert(key + ":" + hash, QLatin1String(""), cacheNegativeTtl);
+    }
+}
+
+/** Returns a reply for a lookup against the HTTP backend.
+ *
+ *  Concurrent lookups for the same credentials share a single request,
+ *  and requests beyond httpMaxRequests wait for a slot, unless
+ *  httpMaxQueue lookups are already waiting.
+ */
+QXmppPasswordReply *XmppPasswordCheckerPrivate::httpLookup(bool isDigest, const QString &cacheKey, const QString &cacheValue, const QByteArray &data)
+{
+    const QString key = QString("%1:%2:%3").arg(isDigest ? "digest" : "password", cacheKey, cacheValue);
+    QXmppPasswordReply *reply = new QXmppPasswordReply;
+
+    HttpLookup *lookup = httpLookups.value(key);
+    if (lookup) {
+        q->updateCounter("auth.http.coalesced");
+        lookup->replies << reply;
+        return reply;
+    }
+
+    lookup = new HttpLookup;
+    lookup->key = key;
+    lookup->isDigest = isDigest;
+    lookup->cacheKey = cacheKey;
+    lookup->cacheValue = cacheValue;
+    lookup->data = data;
+    lookup->replies << reply;
+    httpLookups.insert(key, lookup);
+
+    if (isBreakerOpen()) {
+        // the backend is failing, do not add to its load
+        q->updateCounter("auth.http.rejected");
+        finishLookup(lookup, QXmppPasswordReply::TemporaryError, QByteArray());
+    } else if (httpRequests.size() < httpMaxRequests) {
+        startLookup(lookup);
+    } else if (httpQueue.size() >= httpMaxQueue) {
+        // the backend cannot keep up, fail fast
+        q->updateCounter("auth.http.overflow");
+        finishLookup(lookup, QXmppPasswordReply::TemporaryError, QByteArray());
+    } else {
+        q->updateCounter("auth.http.queued");
+        httpQueue.enqueue(lookup);
+    }
+    return reply;
+}
+
+/** Completes all the replies waiting for the given \a lookup.
+ *
+ *  If the backend failed, stale cached credentials are used if
+ *  available.
+ */
+void XmppPasswordCheckerPrivate::finishLookup(HttpLookup *lookup, QXmppPasswordReply::Error error, const QByteArray &digest)
+{
+    QByteArray replyDigest = digest;
+    if (error == QXmppPasswordReply::TemporaryError) {
+        const QString stale = cache.get(lookup->cacheKey, true);
+        if (!stale.isNull() && (lookup->isDigest || stale == lookup->cacheValue)) {
+            q->updateCounter("auth.cache.stale");
+            error = QXmppPasswordReply::NoError;
+            if (lookup->isDigest)
+                replyDigest = QByteArray::fromHex(stale.toAscii());
+        }
+    }
+
+    foreach (const QPointer<QXmppPasswordReply> &reply, lookup->replies) {
+        if (!reply)
+            continue;
+        if (error != QXmppPasswordReply::NoError)
+            reply->setError(error);
+        else if (lookup->isDigest)
+            reply->setDigest(replyDigest);
+        reply->finishLater();
+    }
+    httpLookups.remove(lookup->key);
+    delete lookup;
+}
+
+/** Returns true if requests to the HTTP backend are currently suspended
+ *  because of repeated failures.
+ */
+bool XmppPasswordCheckerPrivate::isBreakerOpen() const
+{
+    return httpFailures >= httpFailureThreshold &&
+           httpRetryTime > QDateTime::currentMSecsSinceEpoch();
+}
+
+/** Sends the request for the given \a lookup to the HTTP backend.
+ *
+ *  The request is aborted if the backend does not answer within
+ *  httpTimeout seconds, which counts as a backend failure.
+ */
+void XmppPasswordCheckerPrivate::startLookup(HttpLookup *lookup)
+{
+    bool check;
+    Q_UNUSED(check);
+
+    QNetworkRequest networkRequest(url.toString());
+    networkRequest.setRawHeader("Content-Type", "application/x-www-form-urlencoded");
+    networkRequest.setRawHeader("User-Agent", QString(qApp->applicationName() + "/" + qApp->applicationVersion()).toAscii());
+    QNetworkReply *networkReply = network->post(networkRequest, lookup->data);
+    httpRequests.insert(networkReply, lookup);
+
+    check = QObject::connect(networkReply, SIGNAL(finished()),
+                             q, SLOT(onHttpReply()));
+    Q_ASSERT(check);
+
+    QTimer *timer = new QTimer(networkReply);
+    timer->setSingleShot(true);
+    check = QObject::connect(timer, SIGNAL(timeout()),
+                             networkReply, SLOT(abort()));
+    Q_ASSERT(check);
+    timer->start(httpTimeout * 1000);
+}
+
+/** Sends queued lookups while there are free slots.
+ */
+void XmppPasswordCheckerPrivate::startQueuedLookups()
+{
+    while (!httpQueue.isEmpty() && httpRequests.size() < httpMaxRequests) {
+        HttpLookup *lookup = httpQueue.dequeue();
+        if (isBreakerOpen()) {
+            q->updateCounter("auth.http.rejected");
+            finishLookup(lookup, QXmppPasswordReply::TemporaryError, QByteArray());
+        } else {
+            startLookup(lookup);
+        }
+    }
+}
+
+/** Hands the lookup for \a request to the least busy SQL worker and
+ *  returns a reply which completes when the worker is done.
+ */
+QXmppPasswordReply *XmppPasswordCheckerPrivate::sqlLookup(const QXmppPasswordRequest &request, bool isDigest)
+{
+    bool check;
+    Q_UNUSED(check);
+
+    QXmppPasswordReply *reply = new QXmppPasswordReply;
+    if (sqlWorkers.isEmpty()) {
+        reply->setError(QXmppPasswordReply::TemporaryError);
+        reply->finishLater();
+        return reply;
+    }
+
+    SqlPasswordWorker *worker = sqlWorkers.first();
+    foreach (SqlPasswordWorker *candidate, sqlWorkers) {
+        if (candidate->pending < worker->pending)
+            worker = candidate;
+    }
+
+    const int id = ++sqlLastId;
+    SqlLookup lookup;
+    lookup.isDigest = isDigest;
+    lookup.request = request;
+    lookup.reply = reply;
+    sqlLookups.insert(id, lookup);
+
+    // give up on the lookup if the worker takes too long
+    QTimer *timer = new QTimer(reply);
+    timer->setSingleShot(true);
+    timer->setProperty("__sql_id", id);
+    check = QObject::connect(timer, SIGNAL(timeout()),
+                             q, SLOT(onSqlTimeout()));
+    Q_ASSERT(check);
+    timer->start(sqlTimeout * 1000);
+
+    worker->pending++;
+    q->updateCounter("auth.sql.dispatched");
+    QMetaObject::invokeMethod(worker, "lookup", Qt::QueuedConnection,
+                              Q_ARG(int, id),
+                              Q_ARG(QString, request.username() + "@" + request.domain()));
+    return reply;
+}
+
+/** Loads the cache from the snapshot file, if there is one.
+ */
+void XmppPasswordCheckerPrivate::loadCache()
+{
+    if (cacheFile.isEmpty())
+        return;
+
+    QFile file(cacheFile);
+    if (!file.exists())
+        return;
+    if (!file.open(QIODevice::ReadOnly)) {
+        q->warning("Could not read cache file " + cacheFile);
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_4_6);
+    quint32 magic;
+    stream >> magic;
+    if (magic != cacheFileMagic) {
+        q->warning("Invalid cache file " + cacheFile);
+        return;
+    }
+    cache.load(stream);
+    q->info(QString("Loaded %1 cached credentials from %2").arg(QString::number(cache.size()), cacheFile));
+}
+
+/** Writes the cache to the snapshot file, which is only readable by
+ *  its owner.
+ */
+void XmppPasswordCheckerPrivate::saveCache()
+{
+    if (cacheFile.isEmpty())
+        return;
+
+    // write to a temporary file and move it into place, the file is
+    // created afresh with owner-only permissions so no other user can
+    // ever open it, even if a crash left a previous one behind
+    const QString tmpFile = cacheFile + ".tmp";
+    QFile::remove(tmpFile);
+    const int fd = ::open(QFile::encodeName(tmpFile).constData(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    QFile file;
+    if (fd < 0 || !file.open(fd, QIODevice::WriteOnly, QFileDevice::AutoCloseHandle)) {
+        q->warning("Could not write cache file " + tmpFile);
+        if (fd >= 0)
+            ::close(fd);
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_4_6);
+    stream << cacheFileMagic;
+    cache.save(stream);
+    file.close();
+    if (stream.status() != QDataStream::Ok || file.error() != QFile::NoError ||
+        ::rename(QFile::encodeName(tmpFile).constData(), QFile::encodeName(cacheFile).constData()) != 0) {
+        q->warning("Could not write cache file " + cacheFile);
+        QFile::remove(tmpFile);
+    }
+}
+
+/** Reads the password file into memory. On failure, the passwords which
+ *  were previously loaded are kept.
+ */
+bool XmppPasswordCheckerPrivate::loadPasswords()
+{
+    const QString path = url.toLocalFile();
+    QSettings settings(path, QSettings::IniFormat);
+    if (!QFileInfo(path).isReadable() || settings.status() != QSettings::NoError)
+        return false;
+
+    QHash<QString, QString> newPasswords;
+    newPasswords.reserve(passwords.size());
+    foreach (const QString &key, settings.allKeys())
+        newPasswords.insert(key, settings.value(key).toString());
+
+    // lookups only ever see a complete set of passwords
+    passwords.swap(newPasswords);
+    return true;
+}
+
 XmppPasswordChecker::XmppPasswordChecker()
-    : d(new XmppPasswordCheckerPrivate)
+    : d(new XmppPasswordCheckerPrivate(this))
 {
+    bool check;
+    Q_UNUSED(check);
+
     d->network = 0;
     d->url = QUrl("https://www.wifirst.net/http-auth/");
-    d->settings = 0;
+    d->passwordWatcher = 0;
+
+    d->cache.setMaxSize(10000);
+    d->negativeCache.setMaxSize(10000);
+    d->cachePasswordTtl = 3600;
+    d->cacheDigestTtl = 24 * 3600;
+    d->cacheNegativeTtl = 60;
+    d->cache.setStaleTime(24 * 3600);
+
+    d->cacheTimer = new QTimer(this);
+    d->cacheTimer->setInterval(60000);
+    check = connect(d->cacheTimer, SIGNAL(timeout()),
+                    this, SLOT(onCacheTimeout()));
+    Q_ASSERT(check);
+
+    d->cacheSaveTimer = new QTimer(this);
+    d->cacheSaveTimer->setInterval(300000);
+    check = connect(d->cacheSaveTimer, SIGNAL(timeout()),
+                    this, SLOT(onCacheSaveTimeout()));
+    Q_ASSERT(check);
+
+    // wait for the password file to settle before reloading it
+    d->passwordTimer = new QTimer(this);
+    d->passwordTimer->setInterval(1000);
+    d->passwordTimer->setSingleShot(true);
+    check = connect(d->passwordTimer, SIGNAL(timeout()),
+                    this, SLOT(reload()));
+    Q_ASSERT(check);
 }
 
 XmppPasswordChecker::~XmppPasswordChecker()
 {
+    qDeleteAll(d->httpLookups);
     delete d;
 }
 
@@ -151,40 +845,44 @@ QXmppPasswordReply* XmppPasswordChecker::checkPassword(const QXmppPasswordReques
     const QDateTime now = QDateTime::currentDateTime();
 
     QXmppPasswordReply *reply = 0;
+    const QString key = QString("%1@%2").arg(request.username(), request.domain());
+    const QString hash = hashPassword(request.username(), request.domain(), request.password());
 
     // check cache
-    QString cachedPassword = d->cache.get(QString("%1@%2").arg(request.username(), request.domain()));
-    if (!cachedPassword.isNull() &&
-        (hashPassword(request.username(), request.domain(), request.password()) == cachedPassword))
-    {
+    const QString cachedPassword = d->cache.get(key);
+    if (!cachedPassword.isNull() && hash == cachedPassword) {
+        updateCounter("auth.cache.hit");
         reply = new QXmppPasswordReply;
         reply->finishLater();
         return reply;
     }
+    if (!d->negativeCache.get(key).isNull() || !d->negativeCache.get(key + ":" + hash).isNull()) {
+        updateCounter("auth.cache.hit");
+        reply = new QXmppPasswordReply;
+        reply->setError(QXmppPasswordReply::AuthorizationError);
+        reply->finishLater();
+        return reply;
+    }
+    updateCounter("auth.cache.miss");
 
     // perform authentication check
     if (d->backend == HttpBackend) {
-
-        QNetworkRequest networkRequest(d->url.toString());
-        networkRequest.setRawHeader("Content-Type", "application/x-www-form-urlencoded");
-        networkRequest.setRawHeader("User-Agent", QString(qApp->applicationName() + "/" + qApp->applicationVersion()).toAscii());
         QUrl url;
         url.addQueryItem("domain", request.domain());
         url.addQueryItem("username", request.username());
         url.addQueryItem("password", request.password());
-        QNetworkReply *networkReply = d->network->post(networkRequest, url.encodedQuery());
-
-        // reply
-        reply = new HttpPasswordReply(networkReply);
-    } else {
+        return d->httpLookup(false, key, hash, url.encodedQuery());
+    }
 
-        // query base implementation
+    // query base implementation
+    if (d->backend == SqlBackend)
+        reply = d->sqlLookup(request, false);
+    else
         reply = QXmppPasswordChecker::checkPassword(request);
-    }
 
     // schedule cache update
-    reply->setProperty("__cache_key", QString("%1@%2").arg(request.username(), request.domain()));
-    reply->setProperty("__cache_value", hashPassword(request.username(), request.domain(), request.password()));
+    reply->setProperty("__cache_key", key);
+    reply->setProperty("__cache_value", hash);
     connect(reply, SIGNAL(finished()), this, SLOT(onPasswordReply()));
     return reply;
 }
@@ -198,6 +896,50 @@ void XmppPasswordChecker::onDigestAuthenticationRequired(QNetworkReply *reply, Q
     }
 }
 
+void XmppPasswordChecker::onCacheTimeout()
+{
+    const int expired = d->cache.expire() + d->negativeCache.expire();
+    if (expired)
+        updateCounter("auth.cache.expiry", expired);
+
+    const int evictions = d->cache.takeEvictions() + d->negativeCache.takeEvictions();
+    if (evictions)
+        updateCounter("auth.cache.eviction", evictions);
+
+    setGauge("auth.cache.count", d->cache.size() + d->negativeCache.size());
+}
+
+/** Reloads the password file, if the file backend is in use.
+ *
+ *  This is invoked when the file changes, and when the server receives
+ *  SIGHUP.
+ */
+void XmppPasswordChecker::reload()
+{
+    // the watcher only exists for the file backend
+    if (!d->passwordWatcher)
+        return;
+
+    const QString path = d->url.toLocalFile();
+    if (!d->loadPasswords()) {
+        warning("Cannot reload password file " + path);
+        return;
+    }
+
+    // the file may have been replaced rather than modified
+    if (!d->passwordWatcher->files().contains(path))
+        d->passwordWatcher->addPath(path);
+
+    d->cache.clear();
+    d->negativeCache.clear();
+    info(QString("Loaded %1 passwords from %2").arg(QString::number(d->passwords.size()), path));
+}
+
+void XmppPasswordChecker::onCacheSaveTimeout()
+{
+    d->saveCache();
+}
+
 void XmppPasswordChecker::onDigestReply()
 {
     QXmppPasswordReply *reply = qobject_cast<QXmppPasswordReply*>(sender());
@@ -205,10 +947,104 @@ void XmppPasswordChecker::onDigestReply()
         return;
 
     // update cache
-    if (reply->error() == QXmppPasswordReply::NoError) {
-        const QString key = reply->property("__cache_key").toString();
-        const QString value = reply->digest().toHex();
-        d->cache.set(key, value, 24*3600);
+    d->cacheDigest(reply->property("__cache_key").toString(), reply->error(), reply->digest());
+}
+
+void XmppPasswordChecker::onHttpReply()
+{
+    QNetworkReply *networkReply = qobject_cast<QNetworkReply*>(sender());
+    if (!networkReply)
+        return;
+    networkReply->deleteLater();
+
+    HttpLookup *lookup = d->httpRequests.take(networkReply);
+    if (!lookup)
+        return;
+
+    QXmppPasswordReply::Error error;
+    QByteArray digest;
+    if (networkReply->error() == QNetworkReply::NoError) {
+        error = QXmppPasswordReply::NoError;
+        if (lookup->isDigest)
+            digest = QByteArray::fromHex(networkReply->readAll());
+    } else if (networkReply->error() == QNetworkReply::ContentNotFoundError) {
+        error = QXmppPasswordReply::AuthorizationError;
+    } else {
+        if (networkReply->error() == QNetworkReply::OperationCanceledError)
+            updateCounter("auth.http.timeout");
+        error = QXmppPasswordReply::TemporaryError;
+    }
+
+    // track backend health
+    if (error == QXmppPasswordReply::TemporaryError) {
+        updateCounter("auth.http.failure");
+        if (++d->httpFailures >= httpFailureThreshold) {
+            if (d->httpFailures == httpFailureThreshold)
+                warning(QString("HTTP authentication backend is failing, suspending requests for %1s").arg(httpRetryDelay));
+            d->httpRetryTime = QDateTime::currentMSecsSinceEpoch() + httpRetryDelay * 1000;
+        }
+    } else {
+        if (d->httpFailures >= httpFailureThreshold)
+            info("HTTP authentication backend recovered");
+        d->httpFailures = 0;
+    }
+
+    // update cache
+    if (lookup->isDigest)
+        d->cacheDigest(lookup->cacheKey, error, digest);
+    else
+        d->cachePassword(lookup->cacheKey, lookup->cacheValue, error);
+
+    d->finishLookup(lookup, error, digest);
+    d->startQueuedLookups();
+}
+
+void XmppPasswordChecker::onSqlError(const QString &message)
+{
+    warning(message);
+}
+
+void XmppPasswordChecker::onSqlReply(int id, int error, const QString &password)
+{
+    SqlPasswordWorker *worker = qobject_cast<SqlPasswordWorker*>(sender());
+    if (worker)
+        worker->pending--;
+
+    // the lookup may have timed out
+    if (!d->sqlLookups.contains(id))
+        return;
+    const SqlLookup lookup = d->sqlLookups.take(id);
+    if (!lookup.reply)
+        return;
+
+    const QXmppPasswordRequest &request = lookup.request;
+    if (error != QXmppPasswordReply::NoError) {
+        lookup.reply->setError(QXmppPasswordReply::Error(error));
+    } else if (lookup.isDigest) {
+        const QByteArray input = QString("%1:%2:%3").arg(request.username(), request.domain(), password).toUtf8();
+        lookup.reply->setDigest(QCryptographicHash::hash(input, QCryptographicHash::Md5));
+    } else if (password != request.password()) {
+        lookup.reply->setError(QXmppPasswordReply::AuthorizationError);
+    }
+    lookup.reply->finish();
+}
+
+void XmppPasswordChecker::onSqlTimeout()
+{
+    QTimer *timer = qobject_cast<QTimer*>(sender());
+    if (!timer)
+        return;
+
+    const int id = timer->property("__sql_id").toInt();
+    if (!d->sqlLookups.contains(id))
+        return;
+    const SqlLookup lookup = d->sqlLookups.take(id);
+
+    updateCounter("auth.sql.timeout");
+    warning(QString("SQL lookup for %1@%2 timed out").arg(lookup.request.username(), lookup.request.domain()));
+    if (lookup.reply) {
+        lookup.reply->setError(QXmppPasswordReply::TemporaryError);
+        lookup.reply->finish();
     }
 }
 
@@ -219,48 +1055,51 @@ void XmppPasswordChecker::onPasswordReply()
         return;
 
     // update cache
-    if (reply->error() == QXmppPasswordReply::NoError) {
-        const QString key = reply->property("__cache_key").toString();
-        const QString value = reply->property("__cache_value").toString();
-        d->cache.set(key, value, 3600);
-    }
+    d->cachePassword(reply->property("__cache_key").toString(),
+                     reply->property("__cache_value").toString(),
+                     reply->error());
 }
 
 QXmppPasswordReply *XmppPasswordChecker::getDigest(const QXmppPasswordRequest &request)
 {
     const QDateTime now = QDateTime::currentDateTime();
     QXmppPasswordReply *reply = 0;
+    const QString key = QString("%1@%2").arg(request.username(), request.domain());
 
     // check cache
-    QString cachedPassword = d->cache.get(QString("%1@%2").arg(request.username(), request.domain()));
+    const QString cachedPassword = d->cache.get(key);
     if (!cachedPassword.isNull()) {
+        updateCounter("auth.cache.hit");
         reply = new QXmppPasswordReply;
         reply->setDigest(QByteArray::fromHex(cachedPassword.toAscii()));
         reply->finishLater();
         return reply;
     }
+    if (!d->negativeCache.get(key).isNull()) {
+        updateCounter("auth.cache.hit");
+        reply = new QXmppPasswordReply;
+        reply->setError(QXmppPasswordReply::AuthorizationError);
+        reply->finishLater();
+        return reply;
+    }
+    updateCounter("auth.cache.miss");
 
     if (d->backend == HttpBackend && d->url.isValid()) {
-        QNetworkRequest networkRequest(d->url.toString());
-        networkRequest.setRawHeader("Content-Type", "application/x-www-form-urlencoded");
-        networkRequest.setRawHeader("User-Agent", QString(qApp->applicationName() + "/" + qApp->applicationVersion()).toAscii());
         QUrl url;
         url.addQueryItem("username", request.username());
         url.addQueryItem("domain", request.domain());
-        QNetworkReply *networkReply = d->network->post(networkRequest, url.encodedQuery());
-
-        // reply
-        reply = new HttpPasswordReply(networkReply);
-
-    } else {
+        return d->httpLookup(true, key, QString(), url.encodedQuery());
+    }
 
-        // query base implementation
+    // query base implementation
+    if (d->backend == SqlBackend)
+        reply = d->sqlLookup(request, true);
+    else
         reply = QXmppPasswordChecker::getDigest(request);
-    }
     Q_ASSERT(reply);
 
     // schedule cache update
-    reply->setProperty("__cache_key", QString("%1@%2").arg(request.username(), request.domain()));
+    reply->setProperty("__cache_key", key);
     connect(reply, SIGNAL(finished()), this, SLOT(onDigestReply()));
     return reply;
 }
@@ -269,27 +1108,14 @@ QXmppPasswordReply::Error XmppPasswordChecker::getPassword(const QXmppPasswordRe
 {
     if (d->backend == FileBackend) {
         const QString key = request.domain() + "/" + request.username();
-        if (d->settings->status() != QSettings::NoError)
-            return QXmppPasswordReply::TemporaryError;
-        if (!d->settings->contains(key))
-            return QXmppPasswordReply::AuthorizationError;
-        password = d->settings->value(key).toString();
-        return QXmppPasswordReply::NoError;
-    }
-    else if (d->backend == SqlBackend) {
-        const QString jid = request.username() + "@" + request.domain();
-        QSqlQuery query(d->sqlDatabase);
-        query.prepare(d->sqlGetQuery);
-        query.addBindValue(jid);
-        if (!query.exec()) {
-            warning(QString("Could not retrieve password from SQL for %1: %2").arg(jid, query.lastError().text()));
-            return QXmppPasswordReply::TemporaryError;
-        }
-        if (!query.next() || query.value(0).toString() != jid)
+        QHash<QString, QString>::const_iterator it = d->passwords.constFind(key);
+        if (it == d->passwords.constEnd())
             return QXmppPasswordReply::AuthorizationError;
-        password = query.value(1).toString();
+        password = it.value();
         return QXmppPasswordReply::NoError;
     }
+    // SQL lookups are performed asynchronously by checkPassword() and
+    // getDigest(), so as not to block the event loop
     return QXmppPasswordReply::TemporaryError;
 }
 
@@ -300,14 +1126,22 @@ bool XmppPasswordChecker::hasGetPassword() const
 
 bool XmppPasswordChecker::start()
 {
+    bool check;
+    Q_UNUSED(check);
+
     const QString scheme = d->url.scheme();
     if (scheme == "file") {
         d->backend = FileBackend;
-        d->settings = new QSettings(d->url.toLocalFile(), QSettings::IniFormat, this);
-        if (d->settings->status() != QSettings::NoError) {
+        if (!d->loadPasswords()) {
             warning("Cannot open password file");
             return false;
         }
+
+        // reload the passwords when the file changes
+        d->passwordWatcher = new QFileSystemWatcher(QStringList() << d->url.toLocalFile(), this);
+        check = connect(d->passwordWatcher, SIGNAL(fileChanged(QString)),
+                        d->passwordTimer, SLOT(start()));
+        Q_ASSERT(check);
     }
     else if (scheme == "http" || scheme == "https") {
         d->backend = HttpBackend;
@@ -315,41 +1149,285 @@ bool XmppPasswordChecker::start()
         connect(d->network, SIGNAL(authenticationRequired(QNetworkReply*,QAuthenticator*)),
                 this, SLOT(onDigestAuthenticationRequired(QNetworkReply*,QAuthenticator*)));
     }
-    else if (scheme == "mysql") {
+    else if (scheme == "mysql" || scheme == "sqlite") {
         if (!d->url.hasQueryItem("jid_field") || !d->url.hasQueryItem("password_field")) {
             warning("SQL auth URL requires jid_field and password_field");
             return false;
         }
 
-        d->backend = SqlBackend;
-        d->sqlDatabase = QSqlDatabase::addDatabase("QMYSQL", "_auth_connection");
-        d->sqlDatabase.setConnectOptions("MYSQL_OPT_RECONNECT=1");
-        d->sqlDatabase.setDatabaseName(d->url.path().mid(1));
-        d->sqlDatabase.setHostName(d->url.host());
-        d->sqlDatabase.setUserName(d->user);
-        d->sqlDatabase.setPassword(d->password);
-        if (!d->sqlDatabase.open()) {
+        // check the database can be opened
+        bool opened;
+        {
+            QSqlDatabase db = addSqlDatabase("_auth_connection", d->url, d->user, d->password, d->sqlTimeout);
+            opened = db.open();
+            db.close();
+        }
+        QSqlDatabase::removeDatabase("_auth_connection");
+        if (!opened) {
             warning("Cannot open SQL database");
             return false;
         }
+
+        d->backend = SqlBackend;
         d->sqlGetQuery = QString("SELECT %1, %2 FROM %3 WHERE %4 = ?").arg(
             d->url.queryItemValue("jid_field"),
             d->url.queryItemValue("password_field"),
             d->url.queryItemValue("table"),
             d->url.queryItemValue("jid_field"));
+
+        // each worker has its own connection
+        for (int i = 0; i < qMax(1, d->sqlWorkerCount); ++i) {
+            SqlPasswordWorker *worker = new SqlPasswordWorker(
+                QString("_auth_connection_%1").arg(i),
+                d->url, d->user, d->password, d->sqlGetQuery, d->sqlTimeout);
+            check = connect(worker, SIGNAL(passwordFound(int,int,QString)),
+                            this, SLOT(onSqlReply(int,int,QString)));
+            Q_ASSERT(check);
+            check = connect(worker, SIGNAL(sqlError(QString)),
+                            this, SLOT(onSqlError(QString)));
+            Q_ASSERT(check);
+
+            QThread *thread = new QThread(this);
+            worker->moveToThread(thread);
+            thread->start();
+            d->sqlWorkers << worker;
+            d->sqlThreads << thread;
+        }
     }
     else {
         warning("Unsupported authentication URL " + d->url.toString());
         return false;
     }
 
+    d->loadCache();
+    if (!d->cacheFile.isEmpty())
+        d->cacheSaveTimer->start();
+
     server()->setPasswordChecker(this);
+    d->cacheTimer->start();
     return true;
 }
 
 void XmppPasswordChecker::stop()
 {
+    d->passwordTimer->stop();
+    delete d->passwordWatcher;
+    d->passwordWatcher = 0;
+    d->cacheTimer->stop();
+    d->cacheSaveTimer->stop();
+    d->saveCache();
     server()->setPasswordChecker(0);
+
+    // fail the lookups which are still in progress, their results would
+    // never be delivered
+    foreach (const SqlLookup &lookup, d->sqlLookups) {
+        if (lookup.reply) {
+            lookup.reply->setError(QXmppPasswordReply::TemporaryError);
+            lookup.reply->finish();
+        }
+    }
+    d->sqlLookups.clear();
+
+    // workers are deleted in their own thread, before it exits; a query
+    // in progress is bounded by the connection timeouts
+    foreach (SqlPasswordWorker *worker, d->sqlWorkers)
+        worker->deleteLater();
+    foreach (QThread *thread, d->sqlThreads) {
+        thread->quit();
+        thread->wait();
+        delete thread;
+    }
+    d->sqlWorkers.clear();
+    d->sqlThreads.clear();
+}
+
+/** Returns the path of the file to which the credentials cache is saved.
+ */
+QString XmppPasswordChecker::cacheFile() const
+{
+    return d->cacheFile;
+}
+
+/** Sets the path of the file to which the credentials cache is saved
+ *  periodically and on shutdown, and from which it is loaded on startup.
+ *
+ *  The file is only readable by its owner. If empty, which is the
+ *  default, the cache is not saved.
+ *
+ * @param cacheFile
+ */
+void XmppPasswordChecker::setCacheFile(const QString &cacheFile)
+{
+    d->cacheFile = cacheFile;
+}
+
+/** Returns the maximum number of entries in the credentials cache.
+ */
+int XmppPasswordChecker::cacheSize() const
+{
+    return d->cache.maxSize();
+}
+
+/** Sets the maximum number of entries in the credentials cache. The same
+ *  limit applies separately to failed lookups.
+ *
+ * @param size
+ */
+void XmppPasswordChecker::setCacheSize(int size)
+{
+    d->cache.setMaxSize(size);
+    d->negativeCache.setMaxSize(size);
+}
+
+/** Returns the number of seconds for which a checked password is cached.
+ */
+int XmppPasswordChecker::cachePasswordTtl() const
+{
+    return d->cachePasswordTtl;
+}
+
+/** Sets the number of seconds for which a checked password is cached.
+ *
+ * @param ttl
+ */
+void XmppPasswordChecker::setCachePasswordTtl(int ttl)
+{
+    d->cachePasswordTtl = ttl;
+}
+
+/** Returns the number of seconds for which a password digest is cached.
+ */
+int XmppPasswordChecker::cacheDigestTtl() const
+{
+    return d->cacheDigestTtl;
+}
+
+/** Sets the number of seconds for which a password digest is cached.
+ *
+ * @param ttl
+ */
+void XmppPasswordChecker::setCacheDigestTtl(int ttl)
+{
+    d->cacheDigestTtl = ttl;
+}
+
+/** Returns the number of seconds for which expired credentials can still
+ *  be used while the HTTP backend is failing.
+ */
+int XmppPasswordChecker::cacheStaleTtl() const
+{
+    return d->cache.staleTime();
+}
+
+/** Sets the number of seconds for which expired credentials can still
+ *  be used while the HTTP backend is failing.
+ *
+ * @param ttl
+ */
+void XmppPasswordChecker::setCacheStaleTtl(int ttl)
+{
+    d->cache.setStaleTime(ttl);
+}
+
+/** Returns the maximum number of concurrent requests to the HTTP backend.
+ */
+int XmppPasswordChecker::httpMaxRequests() const
+{
+    return d->httpMaxRequests;
+}
+
+/** Sets the maximum number of concurrent requests to the HTTP backend,
+ *  further requests are queued.
+ *
+ * @param count
+ */
+void XmppPasswordChecker::setHttpMaxRequests(int count)
+{
+    d->httpMaxRequests = qMax(1, count);
+}
+
+/** Returns the maximum number of lookups waiting for a request slot.
+ */
+int XmppPasswordChecker::httpMaxQueue() const
+{
+    return d->httpMaxQueue;
+}
+
+/** Sets the maximum number of lookups waiting for a request slot, further
+ *  lookups fail immediately.
+ *
+ * @param count
+ */
+void XmppPasswordChecker::setHttpMaxQueue(int count)
+{
+    d->httpMaxQueue = qMax(0, count);
+}
+
+/** Returns the number of seconds after which a request to the HTTP
+ *  backend is aborted.
+ */
+int XmppPasswordChecker::httpTimeout() const
+{
+    return d->httpTimeout;
+}
+
+/** Sets the number of seconds after which a request to the HTTP backend
+ *  is aborted.
+ *
+ * @param timeout
+ */
+void XmppPasswordChecker::setHttpTimeout(int timeout)
+{
+    d->httpTimeout = qMax(1, timeout);
+}
+
+/** Returns the number of seconds after which an SQL lookup fails.
+ */
+int XmppPasswordChecker::sqlTimeout() const
+{
+    return d->sqlTimeout;
+}
+
+/** Sets the number of seconds after which an SQL lookup fails.
+ *
+ * @param timeout
+ */
+void XmppPasswordChecker::setSqlTimeout(int timeout)
+{
+    d->sqlTimeout = timeout;
+}
+
+/** Returns the number of threads performing SQL lookups.
+ */
+int XmppPasswordChecker::sqlWorkers() const
+{
+    return d->sqlWorkerCount;
+}
+
+/** Sets the number of threads performing SQL lookups, each of them
+ *  has its own database connection.
+ *
+ * @param count
+ */
+void XmppPasswordChecker::setSqlWorkers(int count)
+{
+    d->sqlWorkerCount = count;
+}
+
+/** Returns the number of seconds for which a failed lookup is cached.
+ */
+int XmppPasswordChecker::cacheNegativeTtl() const
+{
+    return d->cacheNegativeTtl;
+}
+
+/** Sets the number of seconds for which a failed lookup is cached.
+ *
+ * @param ttl
+ */
+void XmppPasswordChecker::setCacheNegativeTtl(int ttl)
+{
+    d->cacheNegativeTtl = ttl;
 }
 
 QString XmppPasswordChecker::user() const
@@ -385,6 +1463,7 @@ QString XmppPasswordChecker::url() const
  *  file:///etc/xmpp-users.ini
  *  http://www.example.com/auth
  *  mysql://mysql.example.com/some_database?table=some_table&password_field=some_pwd_field&jid_field=some_jid_field
+ *  sqlite:///var/lib/xmpp-users.db?table=some_table&password_field=some_pwd_field&jid_field=some_jid_field
  *
  * @param url
  */
@@ -22,6 +22,7 @@
 
 #include <QDateTime>
 #include <QStringList>
+#include <QUrl>
 
 #include "QDjangoModel.h"
 
@@ -30,20 +31,35 @@
 
 class QAuthenticator;
 class QNetworkReply;
+class QSqlQuery;
 class XmppPasswordCheckerPrivate;
 
-class HttpPasswordReply : public QXmppPasswordReply
+class SqlPasswordWorker : public QObject
 {
     Q_OBJECT
 
 public:
-    HttpPasswordReply(QNetworkReply *reply);
+    SqlPasswordWorker(const QString &connectionName, const QUrl &url, const QString &user, const QString &password, const QString &query, int timeout);
+    ~SqlPasswordWorker();
 
-private slots:
-    void onFinished();
+    // number of lookups handed to this worker, only used by the main thread
+    int pending;
+
+signals:
+    void passwordFound(int id, int error, const QString &password);
+    void sqlError(const QString &message);
+
+public slots:
+    void lookup(int id, const QString &jid);
 
 private:
-    QNetworkReply *m_networkReply;
+    QString m_connectionName;
+    QString m_password;
+    QString m_queryString;
+    int m_timeout;
+    QUrl m_url;
+    QString m_user;
+    QSqlQuery *m_query;
 };
 
 class XmppPasswordChecker : public QXmppServerExtension, QXmppPasswordChecker
@@ -53,6 +69,17 @@ class XmppPasswordChecker : public QXmppServerExtension, QXmppPasswordChecker
     Q_PROPERTY(QString url READ url WRITE setUrl);
     Q_PROPERTY(QString user READ user WRITE setUser);
     Q_PROPERTY(QString password READ password WRITE setPassword);
+    Q_PROPERTY(QString cacheFile READ cacheFile WRITE setCacheFile);
+    Q_PROPERTY(int cacheSize READ cacheSize WRITE setCacheSize);
+    Q_PROPERTY(int cachePasswordTtl READ cachePasswordTtl WRITE setCachePasswordTtl);
+    Q_PROPERTY(int cacheDigestTtl READ cacheDigestTtl WRITE setCacheDigestTtl);
+    Q_PROPERTY(int cacheNegativeTtl READ cacheNegativeTtl WRITE setCacheNegativeTtl);
+    Q_PROPERTY(int cacheStaleTtl READ cacheStaleTtl WRITE setCacheStaleTtl);
+    Q_PROPERTY(int httpMaxQueue READ httpMaxQueue WRITE setHttpMaxQueue);
+    Q_PROPERTY(int httpMaxRequests READ httpMaxRequests WRITE setHttpMaxRequests);
+    Q_PROPERTY(int httpTimeout READ httpTimeout WRITE setHttpTimeout);
+    Q_PROPERTY(int sqlTimeout READ sqlTimeout WRITE setSqlTimeout);
+    Q_PROPERTY(int sqlWorkers READ sqlWorkers WRITE setSqlWorkers);
 
 public:
     XmppPasswordChecker();
@@ -67,6 +94,39 @@ public:
     QString password() const;
     void setPassword(const QString &password);
 
+    QString cacheFile() const;
+    void setCacheFile(const QString &cacheFile);
+
+    int cacheSize() const;
+    void setCacheSize(int size);
+
+    int cachePasswordTtl() const;
+    void setCachePasswordTtl(int ttl);
+
+    int cacheDigestTtl() const;
+    void setCacheDigestTtl(int ttl);
+
+    int cacheNegativeTtl() const;
+    void setCacheNegativeTtl(int ttl);
+
+    int cacheStaleTtl() const;
+    void setCacheStaleTtl(int ttl);
+
+    int httpMaxQueue() const;
+    void setHttpMaxQueue(int count);
+
+    int httpMaxRequests() const;
+    void setHttpMaxRequests(int count);
+
+    int httpTimeout() const;
+    void setHttpTimeout(int timeout);
+
+    int sqlTimeout() const;
+    void setSqlTimeout(int timeout);
+
+    int sqlWorkers() const;
+    void setSqlWorkers(int count);
+
     // password checker
     QXmppPasswordReply *checkPassword(const QXmppPasswordRequest &request);
     QXmppPasswordReply *getDigest(const QXmppPasswordRequest &request);
@@ -77,13 +137,23 @@ public:
     bool start();
     void stop();
 
+public slots:
+    void reload();
+
 private slots:
+    void onCacheSaveTimeout();
+    void onCacheTimeout();
     void onDigestAuthenticationRequired(QNetworkReply *reply, QAuthenticator *authenticator);
     void onDigestReply();
+    void onHttpReply();
     void onPasswordReply();
+    void onSqlError(const QString &message);
+    void onSqlReply(int id, int error, const QString &password);
+    void onSqlTimeout();
 
 private:
     XmppPasswordCheckerPrivate * const d;
+    friend class XmppPasswordCheckerPrivate;
 };
 
 #endif
@@ -68,9 +68,63 @@ void ProxyResponse::onReply()
     emit ready();
 }
 
+ProxyBatchResponse::ProxyBatchResponse(const QStringList &usernames, const QList<QXmppPasswordReply*> &replies)
+    : m_isReady(false),
+    m_pending(replies.size()),
+    m_replies(replies),
+    m_usernames(usernames)
+{
+    bool check;
+    Q_UNUSED(check);
+
+    setHeader("Content-Type", "text/plain");
+
+    foreach (QXmppPasswordReply *reply, m_replies) {
+        reply->setParent(this);
+        check = connect(reply, SIGNAL(finished()),
+                        this, SLOT(onReply()));
+        Q_ASSERT(check);
+    }
+}
+
+bool ProxyBatchResponse::isReady() const
+{
+    return m_isReady;
+}
+
+void ProxyBatchResponse::onReply()
+{
+    if (--m_pending > 0)
+        return;
+
+    // one line per credential pair, in the order of the request
+    QByteArray body;
+    for (int i = 0; i < m_replies.size(); ++i) {
+        int statusCode;
+        const QXmppPasswordReply::Error error = m_replies[i]->error();
+        if (error == QXmppPasswordReply::NoError)
+            statusCode = QDjangoHttpResponse::OK;
+        else if (error == QXmppPasswordReply::AuthorizationError)
+            statusCode = QDjangoHttpResponse::NotFound;
+        else
+            statusCode = QDjangoHttpResponse::InternalServerError;
+        body += QByteArray::number(statusCode) + ' ' + m_usernames[i].toUtf8() + '\n';
+    }
+    setBody(body);
+
+    // the last reply is still emitting finished()
+    foreach (QXmppPasswordReply *reply, m_replies)
+        reply->deleteLater();
+    m_replies.clear();
+
+    m_isReady = true;
+    emit ready();
+}
+
 class XmppAuthProxyPrivate
 {
 public:
+    int maxBatchSize;
     QString url;
     QString user;
     QString password;
@@ -79,6 +133,7 @@ public:
 XmppAuthProxy::XmppAuthProxy()
  : d(new XmppAuthProxyPrivate)
 {
+    d->maxBatchSize = 1000;
 }
 
 XmppAuthProxy::~XmppAuthProxy()
@@ -86,6 +141,22 @@ XmppAuthProxy::~XmppAuthProxy()
     delete d;
 }
 
+/** Returns the maximum number of credential pairs in a batch request.
+ */
+int XmppAuthProxy::maxBatchSize() const
+{
+    return d->maxBatchSize;
+}
+
+/** Sets the maximum number of credential pairs in a batch request.
+ *
+ * @param size
+ */
+void XmppAuthProxy::setMaxBatchSize(int size)
+{
+    d->maxBatchSize = size;
+}
+
 QString XmppAuthProxy::url() const
 {
     return d->url;
@@ -145,6 +216,38 @@ QDjangoHttpResponse *XmppAuthProxy::respondToRequest(const QDjangoHttpRequest &r
     if (!url.hasQueryItem("username") || !url.hasQueryItem("password"))
         return serveBadRequest(request);
 
+    // several credential pairs are checked concurrently
+    const QStringList usernames = url.allQueryItemValues("username");
+    if (usernames.size() > 1) {
+        const QStringList passwords = url.allQueryItemValues("password");
+        if (passwords.size() != usernames.size())
+            return serveBadRequest(request);
+
+        // usernames are echoed one per line, they must not span lines
+        foreach (const QString &username, usernames) {
+            if (username.contains('\r') || username.contains('\n'))
+                return serveBadRequest(request);
+        }
+        if (usernames.size() > d->maxBatchSize) {
+            QDjangoHttpResponse *response = new QDjangoHttpResponse;
+            response->setStatusCode(413);
+            response->setReasonPhrase("Request Entity Too Large");
+            return response;
+        }
+
+        QList<QXmppPasswordReply*> replies;
+        for (int i = 0; i < usernames.size(); ++i) {
+            QXmppPasswordRequest pwdRequest;
+            pwdRequest.setDomain(server()->domain());
+            pwdRequest.setUsername(usernames[i]);
+            pwdRequest.setPassword(passwords[i]);
+            replies << checker->checkPassword(pwdRequest);
+        }
+        updateCounter("auth_proxy.batch");
+        updateCounter("auth_proxy.batch.entries", usernames.size());
+        return new ProxyBatchResponse(usernames, replies);
+    }
+
     // check password
     QXmppPasswordRequest pwdRequest;
     pwdRequest.setDomain(server()->domain());
@@ -47,10 +47,36 @@ private:
     QXmppPasswordReply *m_reply;
 };
 
+/** A response to a batch of password checks, which is ready once all the
+ *  checks have completed.
+ *
+ *  The body has one line per credential pair, in the order of the request,
+ *  with the status code which a single check would have returned followed
+ *  by the username.
+ */
+class ProxyBatchResponse : public QDjangoHttpResponse
+{
+    Q_OBJECT
+
+public:
+    ProxyBatchResponse(const QStringList &usernames, const QList<QXmppPasswordReply*> &replies);
+    bool isReady() const;
+
+private slots:
+    void onReply();
+
+private:
+    bool m_isReady;
+    int m_pending;
+    QList<QXmppPasswordReply*> m_replies;
+    QStringList m_usernames;
+};
+
 class XmppAuthProxy : public QXmppServerExtension, public QDjangoHttpController
 {
     Q_OBJECT
     Q_CLASSINFO("ExtensionName", "auth_proxy");
+    Q_PROPERTY(int maxBatchSize READ maxBatchSize WRITE setMaxBatchSize);
     Q_PROPERTY(QString url READ url WRITE setUrl);
     Q_PROPERTY(QString user READ user WRITE setUser);
     Q_PROPERTY(QString password READ password WRITE setPassword);
@@ -59,6 +85,9 @@ public:
     XmppAuthProxy();
     ~XmppAuthProxy();
 
+    int maxBatchSize() const;
+    void setMaxBatchSize(int size);
+
     QString url() const;
     void setUrl(const QString &url);
 
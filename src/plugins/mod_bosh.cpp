@@ -17,10 +17,14 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstring>
+#include <zlib.h>
+
 #include <QDomDocument>
+#include <QElapsedTimer>
 #include <QStringList>
 #include <QTimer>
-#include <QXmlStreamWriter>
+#include <QXmlStreamReader>
 
 #include "QDjangoHttpController.h"
 #include "QDjangoHttpRequest.h"
@@ -32,6 +36,16 @@
 #include "QXmppServerPlugin.h"
 
 #include "mod_bosh.h"
+#include "mod_http.h"
+
+// maximum number of requests held by the server for a session
+static const int maxHold = 2;
+
+// resolution of the BOSH timeouts, in milliseconds
+static const int wheelTick = 100;
+
+static const char *ns_http_bind = "http://jabber.org/protocol/httpbind";
+static const char *ns_xbosh = "urn:xmpp:xbosh";
 
 static QDjangoHttpResponse *filterResponse(QDjangoHttpResponse *response) {
     response->setHeader("Access-Control-Allow-Origin", "*");
@@ -40,8 +54,23 @@ static QDjangoHttpResponse *filterResponse(QDjangoHttpResponse *response) {
     return response;
 }
 
-BoshResponse::BoshResponse()
+static QDjangoHttpResponse *bodyResponse(const QByteArray &body)
+{
+    QDjangoHttpResponse *response = new QDjangoHttpResponse;
+    response->setHeader("Content-Type", "application/xml; charset=utf-8");
+    response->setBody(body);
+    return filterResponse(response);
+}
+
+static QDjangoHttpResponse *terminateResponse(const QString &condition)
+{
+    return bodyResponse(QString("<body xmlns=\"%1\" type=\"terminate\" condition=\"%2\"/>").arg(
+        ns_http_bind, condition).toUtf8());
+}
+
+BoshResponse::BoshResponse(qint64 rid)
     : m_ready(false)
+    , m_rid(rid)
 {
 }
 
@@ -60,23 +89,722 @@ void BoshResponse::setReady(bool isReady)
         emit ready();
 }
 
+qint64 BoshResponse::rid() const
+{
+    return m_rid;
+}
+
+/** Returns the content coding accepted by the client for this response.
+ */
+QByteArray BoshResponse::encoding() const
+{
+    return m_encoding;
+}
+
+void BoshResponse::setEncoding(const QByteArray &encoding)
+{
+    m_encoding = encoding;
+}
+
+/** A hierarchical timer wheel, which lets many timers share a single
+ *  tick timer. Starting and stopping a timer are O(1).
+ *
+ * The first level has one slot per tick, each of the following levels
+ * has slots spanning a whole turn of the previous one. When the first
+ * level wraps around, the timers in the current slot of the next level
+ * are cascaded down.
+ */
+class TimerWheel
+{
+public:
+    class Timer
+    {
+    public:
+        Timer();
+        virtual ~Timer();
+        bool isActive() const;
+        virtual void timeout() = 0;
+
+    private:
+        Timer *m_prev;
+        Timer *m_next;
+        Timer **m_slot;
+        qint64 m_expiry;
+        TimerWheel *m_wheel;
+        friend class TimerWheel;
+    };
+
+    TimerWheel(int tickInterval);
+
+    bool isEmpty() const;
+    void advance();
+    void start(Timer *timer, int msecs);
+    void stop(Timer *timer);
+
+private:
+    enum {
+        RootBits = 8,
+        LevelBits = 6,
+        Levels = 4,
+        RootSize = 1 << RootBits,
+        LevelSize = 1 << LevelBits,
+    };
+
+    void cascade(int level, int index);
+    qint64 currentTick() const;
+    void detach(Timer **slot, Timer **list);
+    void insert(Timer *timer);
+    void link(Timer *timer, Timer **slot);
+    void unlink(Timer *timer);
+    Q_DISABLE_COPY(TimerWheel)
+
+    QElapsedTimer m_clock;
+    int m_count;
+    qint64 m_current;
+    int m_tickInterval;
+    Timer *m_root[RootSize];
+    Timer *m_levels[Levels - 1][LevelSize];
+};
+
+TimerWheel::Timer::Timer()
+    : m_prev(0)
+    , m_next(0)
+    , m_slot(0)
+    , m_expiry(0)
+    , m_wheel(0)
+{
+}
+
+TimerWheel::Timer::~Timer()
+{
+    if (m_wheel)
+        m_wheel->stop(this);
+}
+
+bool TimerWheel::Timer::isActive() const
+{
+    return m_slot != 0;
+}
+
+TimerWheel::TimerWheel(int tickInterval)
+    : m_count(0)
+    , m_current(0)
+    , m_tickInterval(tickInterval)
+{
+    memset(m_root, 0, sizeof(m_root));
+    memset(m_levels, 0, sizeof(m_levels));
+    m_clock.start();
+}
+
+/** Fires the timers which expired since the last call, in order.
+ */
+void TimerWheel::advance()
+{
+    const qint64 target = currentTick();
+    while (m_current <= target && m_count) {
+        const int index = m_current & (RootSize - 1);
+        if (!index) {
+            // cascade timers from the upper levels
+            for (int level = 0; level < Levels - 1; ++level) {
+                const int levelIndex = (m_current >> (RootBits + level * LevelBits)) & (LevelSize - 1);
+                cascade(level, levelIndex);
+                if (levelIndex)
+                    break;
+            }
+        }
+
+        // timers may be started or stopped from within timeout(), so
+        // move the slot's timers to a list of their own first
+        while (m_root[index]) {
+            Timer *expired = 0;
+            detach(&m_root[index], &expired);
+            while (expired) {
+                Timer *timer = expired;
+                stop(timer);
+                timer->timeout();
+            }
+        }
+        m_current++;
+    }
+    if (!m_count)
+        m_current = target + 1;
+}
+
+void TimerWheel::cascade(int level, int index)
+{
+    Timer *list = 0;
+    detach(&m_levels[level][index], &list);
+    while (list) {
+        Timer *timer = list;
+        unlink(timer);
+        insert(timer);
+    }
+}
+
+qint64 TimerWheel::currentTick() const
+{
+    return m_clock.elapsed() / m_tickInterval;
+}
+
+void TimerWheel::detach(Timer **slot, Timer **list)
+{
+    *list = *slot;
+    *slot = 0;
+    for (Timer *timer = *list; timer; timer = timer->m_next)
+        timer->m_slot = list;
+}
+
+void TimerWheel::insert(Timer *timer)
+{
+    // a timer which is already due fires on the next tick
+    qint64 expiry = qMax(timer->m_expiry, m_current);
+    qint64 delta = expiry - m_current;
+    if (delta < RootSize) {
+        link(timer, &m_root[expiry & (RootSize - 1)]);
+        return;
+    }
+
+    // timers beyond the wheel's range are cascaded again when they come up
+    const qint64 range = qint64(1) << (RootBits + (Levels - 1) * LevelBits);
+    if (delta >= range) {
+        expiry = m_current + range - 1;
+        delta = range - 1;
+    }
+    int level = 0;
+    while (delta >= (qint64(1) << (RootBits + (level + 1) * LevelBits)))
+        level++;
+    const int index = (expiry >> (RootBits + level * LevelBits)) & (LevelSize - 1);
+    link(timer, &m_levels[level][index]);
+}
+
+bool TimerWheel::isEmpty() const
+{
+    return m_count == 0;
+}
+
+void TimerWheel::link(Timer *timer, Timer **slot)
+{
+    timer->m_prev = 0;
+    timer->m_next = *slot;
+    if (*slot)
+        (*slot)->m_prev = timer;
+    *slot = timer;
+    timer->m_slot = slot;
+}
+
+/** Starts or restarts the \a timer so that it fires in \a msecs milliseconds.
+ */
+void TimerWheel::start(Timer *timer, int msecs)
+{
+    stop(timer);
+
+    // the wheel does not turn while it is empty
+    if (!m_count)
+        m_current = currentTick();
+
+    timer->m_expiry = currentTick() + (msecs + m_tickInterval - 1) / m_tickInterval;
+    timer->m_wheel = this;
+    insert(timer);
+    m_count++;
+}
+
+/** Stops the \a timer if it is active.
+ */
+void TimerWheel::stop(Timer *timer)
+{
+    if (!timer->isActive())
+        return;
+
+    unlink(timer);
+    timer->m_wheel = 0;
+    m_count--;
+}
+
+void TimerWheel::unlink(Timer *timer)
+{
+    if (timer->m_prev)
+        timer->m_prev->m_next = timer->m_next;
+    else
+        *timer->m_slot = timer->m_next;
+    if (timer->m_next)
+        timer->m_next->m_prev = timer->m_prev;
+    timer->m_prev = 0;
+    timer->m_next = 0;
+    timer->m_slot = 0;
+}
+
+/** Reads a BOSH request body incrementally, building the DOM of one
+ *  top-level stanza at a time.
+ */
+class BoshBodyReader
+{
+public:
+    BoshBodyReader(const QByteArray &data);
+
+    QDomElement body() const;
+    bool hasError() const;
+    bool readBody();
+    QDomElement readStanza();
+
+private:
+    QDomElement createElement();
+    QDomElement readElement();
+
+    QDomDocument m_doc;
+    QDomElement m_body;
+    QXmlStreamReader m_reader;
+};
+
+BoshBodyReader::BoshBodyReader(const QByteArray &data)
+    : m_reader(data)
+{
+}
+
+/** Returns the <body/> element, with its attributes but without
+ *  its children.
+ */
+QDomElement BoshBodyReader::body() const
+{
+    return m_body;
+}
+
+bool BoshBodyReader::hasError() const
+{
+    return m_reader.hasError();
+}
+
+/** Reads up to the <body/> start tag.
+ *
+ * Returns false if the data does not start with a <body/> element.
+ */
+bool BoshBodyReader::readBody()
+{
+    if (!m_reader.readNextStartElement() || m_reader.name() != "body")
+        return false;
+
+    m_body = createElement();
+    return true;
+}
+
+/** Creates an element for the current start tag, with its attributes.
+ */
+QDomElement BoshBodyReader::createElement()
+{
+    QDomElement element = m_doc.createElementNS(m_reader.namespaceUri().toString(), m_reader.qualifiedName().toString());
+    foreach (const QXmlStreamAttribute &attribute, m_reader.attributes()) {
+        if (attribute.namespaceUri().isEmpty())
+            element.setAttribute(attribute.name().toString(), attribute.value().toString());
+        else
+            element.setAttributeNS(attribute.namespaceUri().toString(), attribute.qualifiedName().toString(), attribute.value().toString());
+    }
+    return element;
+}
+
+QDomElement BoshBodyReader::readElement()
+{
+    QDomElement element = createElement();
+    while (!m_reader.atEnd()) {
+        switch (m_reader.readNext()) {
+        case QXmlStreamReader::StartElement:
+            element.appendChild(readElement());
+            break;
+        case QXmlStreamReader::EndElement:
+            return element;
+        case QXmlStreamReader::Characters:
+            if (!m_reader.isWhitespace())
+                element.appendChild(m_doc.createTextNode(m_reader.text().toString()));
+            break;
+        default:
+            break;
+        }
+    }
+    return element;
+}
+
+/** Reads the next top-level stanza.
+ *
+ * Returns a null element once the end of the body is reached, or if
+ * the XML is invalid.
+ */
+QDomElement BoshBodyReader::readStanza()
+{
+    if (m_reader.readNextStartElement()) {
+        const QDomElement stanza = readElement();
+        if (!m_reader.hasError())
+            return stanza;
+    }
+    return QDomElement();
+}
+
+/** The state of a BOSH session: its stream and its window of requests.
+ *
+ * The session's timer expires when the client has been inactive for
+ * too long.
+ */
+class BoshSession : public TimerWheel::Timer
+{
+public:
+    void timeout();
+
+    QXmppIncomingBosh *stream;
+
+    // set once the stream is disconnected, the session is then deleted
+    // from the event loop as callers may still hold it
+    bool closed;
+
+    // highest request ID processed so far
+    qint64 lastRid;
+
+    // responses to processed requests, ordered by request ID
+    QList<BoshResponse*> held;
+
+    // requests received ahead of a missing one, and their responses
+    QMap<qint64, QByteArray> bodies;
+    QMap<qint64, BoshResponse*> waiting;
+
+    // responses kept until the client acknowledges them
+    QMap<qint64, QByteArray> sent;
+};
+
+void BoshSession::timeout()
+{
+    stream->disconnectFromHost();
+}
+
+/** A request being held, whose timer expires after the session's
+ *  'wait' period.
+ */
+class BoshWait : public TimerWheel::Timer
+{
+public:
+    void timeout();
+
+    BoshSession *session;
+    BoshResponse *response;
+};
+
+void BoshWait::timeout()
+{
+    QMetaObject::invokeMethod(response, "expired");
+}
+
 class XmppServerBoshPrivate
 {
 public:
-    QMap<QString, QXmppIncomingBosh*> sessions;
-    QMap<QXmppIncomingBosh*, BoshResponse*> responses;
+    XmppServerBoshPrivate();
+    QByteArray compress(const QByteArray &data, const QByteArray &encoding);
+    BoshResponse *createResponse(BoshSession *session, qint64 rid, const QByteArray &encoding);
+    bool handleBody(BoshSession *session, BoshBodyReader &reader);
+    bool handleStanzas(BoshSession *session, BoshBodyReader &reader);
+    void processBodies(BoshSession *session);
+    void releaseResponse(BoshSession *session, BoshResponse *response);
+    void releaseResponses(BoshSession *session);
+    void removeResponse(BoshResponse *response);
+    BoshResponse *replaceResponse(BoshSession *session, qint64 rid, const QByteArray &encoding);
+    void setBody(QDjangoHttpResponse *response, const QByteArray &data, const QByteArray &encoding);
+    void startTimer(TimerWheel::Timer *timer, int msecs);
+    void touchSession(BoshSession *session);
+
+    QHash<QString, BoshSession*> sessions;
+    QHash<QXmppIncomingBosh*, BoshSession*> streams;
+    QHash<BoshResponse*, BoshWait*> waits;
+    QList<BoshSession*> closedSessions;
+
+    // all the wait and inactivity timeouts share a single timer
+    TimerWheel wheel;
+    QTimer *wheelTimer;
+
+    // compressors, reset for every response
+    z_stream deflateStream;
+    z_stream gzipStream;
+    int compressionThreshold;
+
+    XmppServerBosh *q;
 };
 
+XmppServerBoshPrivate::XmppServerBoshPrivate()
+    : wheel(wheelTick)
+{
+}
+
+/** Compresses \a data with the given content coding, reusing the
+ *  compressor's allocated state.
+ */
+QByteArray XmppServerBoshPrivate::compress(const QByteArray &data, const QByteArray &encoding)
+{
+    z_stream *stream = (encoding == "gzip") ? &gzipStream : &deflateStream;
+    if (deflateReset(stream) != Z_OK)
+        return QByteArray();
+
+    QByteArray output;
+    output.resize(deflateBound(stream, data.size()));
+    stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.constData()));
+    stream->avail_in = data.size();
+    stream->next_out = reinterpret_cast<Bytef*>(output.data());
+    stream->avail_out = output.size();
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END)
+        return QByteArray();
+
+    output.resize(output.size() - stream->avail_out);
+    return output;
+}
+
+/** Creates the response to the request with the given \a rid.
+ */
+BoshResponse *XmppServerBoshPrivate::createResponse(BoshSession *session, qint64 rid, const QByteArray &encoding)
+{
+    BoshResponse *response = new BoshResponse(rid);
+    response->setEncoding(encoding);
+    response->setHeader("Content-Type", "application/xml; charset=utf-8");
+    QObject::connect(response, SIGNAL(destroyed(QObject*)), q, SLOT(responseDestroyed(QObject*)));
+    QObject::connect(response, SIGNAL(expired()), q, SLOT(responseExpired()));
+
+    BoshWait *wait = new BoshWait;
+    wait->session = session;
+    wait->response = response;
+    waits.insert(response, wait);
+    startTimer(wait, session->stream->wait() * 1000);
+    return response;
+}
+
+/** Feeds the contents of a request body to the session's stream.
+ *
+ * Returns false if the body is invalid, in which case the session is
+ * terminated.
+ */
+bool XmppServerBoshPrivate::handleBody(BoshSession *session, BoshBodyReader &reader)
+{
+    const QDomElement body = reader.body();
+
+    // drop the responses the client has received
+    if (body.hasAttribute("ack")) {
+        const qint64 ack = body.attribute("ack").toLongLong();
+        while (!session->sent.isEmpty() && session->sent.firstKey() <= ack)
+            session->sent.erase(session->sent.begin());
+    }
+
+    if (body.attribute("restart") == "true" || body.attributeNS(ns_xbosh, "restart") == "true") {
+        session->stream->handleStream(body);
+        if (session->closed)
+            return false;
+    }
+
+    return handleStanzas(session, reader);
+}
+
+/** Hands each stanza of a request body to the session's stream as soon
+ *  as it has been read.
+ *
+ * Returns false if the body is invalid or a stanza caused the stream to
+ * be closed, in which case the session is terminated.
+ */
+bool XmppServerBoshPrivate::handleStanzas(BoshSession *session, BoshBodyReader &reader)
+{
+    QXmppIncomingBosh *stream = session->stream;
+    QDomElement stanza;
+    while (!(stanza = reader.readStanza()).isNull()) {
+        stream->handleStanza(stanza);
+        if (session->closed)
+            return false;
+    }
+
+    if (reader.hasError()) {
+        q->warning(QString("Received invalid XML for BOSH session %1").arg(stream->id()));
+        stream->disconnectFromHost();
+        return false;
+    }
+    return true;
+}
+
+/** Processes the queued requests which directly follow the last
+ *  processed one, in request ID order.
+ */
+void XmppServerBoshPrivate::processBodies(BoshSession *session)
+{
+    while (session->bodies.contains(session->lastRid + 1)) {
+        const qint64 rid = ++session->lastRid;
+        BoshResponse *response = session->waiting.take(rid);
+        if (response)
+            session->held << response;
+
+        BoshBodyReader reader(session->bodies.take(rid));
+        reader.readBody();
+        if (!handleBody(session, reader))
+            return;
+    }
+    releaseResponses(session);
+}
+
+/** Sends the given \a response with the stream's pending data and
+ *  keeps a copy in case the client needs it retransmitted.
+ */
+void XmppServerBoshPrivate::releaseResponse(BoshSession *session, BoshResponse *response)
+{
+    const QByteArray data = session->stream->readPendingData();
+    session->sent.insert(response->rid(), data);
+    while (session->sent.size() > session->stream->requests())
+        session->sent.erase(session->sent.begin());
+
+    removeResponse(response);
+    setBody(response, data, response->encoding());
+    response->setReady(true);
+    touchSession(session);
+}
+
+/** Answers the oldest held request if there is data for the client,
+ *  then answers requests until no more than 'hold' are left waiting.
+ */
+void XmppServerBoshPrivate::releaseResponses(BoshSession *session)
+{
+    if (!session->held.isEmpty() && session->stream->hasPendingData())
+        releaseResponse(session, session->held.first());
+    while (session->held.size() > session->stream->hold())
+        releaseResponse(session, session->held.first());
+}
+
+/** Forgets about the given \a response, whichever session it belongs to.
+ */
+void XmppServerBoshPrivate::removeResponse(BoshResponse *response)
+{
+    BoshWait *wait = waits.take(response);
+    if (!wait)
+        return;
+    BoshSession *session = wait->session;
+    delete wait;
+
+    // the response may already be destroyed, do not dereference it
+    if (!session->held.removeOne(response)) {
+        QMap<qint64, BoshResponse*>::iterator it = session->waiting.begin();
+        while (it != session->waiting.end()) {
+            if (it.value() == response)
+                it = session->waiting.erase(it);
+            else
+                ++it;
+        }
+    }
+}
+
+/** Handles a client resending the request with the given \a rid while
+ *  it is still waiting: the previous response is dropped, as its
+ *  connection is presumably lost, and a new one takes its place.
+ */
+BoshResponse *XmppServerBoshPrivate::replaceResponse(BoshSession *session, qint64 rid, const QByteArray &encoding)
+{
+    BoshResponse *old = 0;
+    foreach (BoshResponse *response, session->held) {
+        if (response->rid() == rid) {
+            old = response;
+            break;
+        }
+    }
+    if (!old)
+        old = session->waiting.value(rid);
+    if (!old)
+        return 0;
+
+    BoshResponse *response = createResponse(session, rid, encoding);
+    const int index = session->held.indexOf(old);
+    if (index >= 0)
+        session->held[index] = response;
+    else
+        session->waiting[rid] = response;
+    delete waits.take(old);
+    old->setReady(true);
+    return response;
+}
+
+/** Sets the \a response body, compressing it if the client accepts
+ *  the given content coding and the body is large enough.
+ */
+void XmppServerBoshPrivate::setBody(QDjangoHttpResponse *response, const QByteArray &data, const QByteArray &encoding)
+{
+    response->setHeader("Vary", "Accept-Encoding");
+    if (encoding.isEmpty() || compressionThreshold <= 0 || data.size() < compressionThreshold) {
+        response->setBody(data);
+        return;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    const QByteArray compressed = compress(data, encoding);
+    q->updateCounter("bosh.compression.encoded");
+    q->updateCounter("bosh.compression.encode_usec", timer.nsecsElapsed() / 1000);
+    if (compressed.isEmpty() || compressed.size() >= data.size()) {
+        response->setBody(data);
+        return;
+    }
+
+    q->updateCounter("bosh.compression.saved", data.size() - compressed.size());
+    response->setHeader("Content-Encoding", QString::fromLatin1(encoding));
+    response->setBody(compressed);
+}
+
+/** Starts the given \a timer, and the wheel's timer if needed.
+ */
+void XmppServerBoshPrivate::startTimer(TimerWheel::Timer *timer, int msecs)
+{
+    wheel.start(timer, msecs);
+    if (!wheelTimer->isActive())
+        wheelTimer->start();
+}
+
+/** Restarts the inactivity timer of the given \a session.
+ */
+void XmppServerBoshPrivate::touchSession(BoshSession *session)
+{
+    startTimer(session, session->stream->inactivity() * 1000);
+}
+
 XmppServerBosh::XmppServerBosh()
     : d(new XmppServerBoshPrivate)
 {
+    bool check;
+    Q_UNUSED(check);
+
+    d->compressionThreshold = 1024;
+    d->q = this;
+
+    d->wheelTimer = new QTimer(this);
+    d->wheelTimer->setInterval(wheelTick);
+    check = connect(d->wheelTimer, SIGNAL(timeout()),
+                    this, SLOT(wheelTimeout()));
+    Q_ASSERT(check);
+
+    memset(&d->deflateStream, 0, sizeof(d->deflateStream));
+    deflateInit2(&d->deflateStream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    memset(&d->gzipStream, 0, sizeof(d->gzipStream));
+    deflateInit2(&d->gzipStream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
 }
 
 XmppServerBosh::~XmppServerBosh()
 {
+    deflateEnd(&d->deflateStream);
+    deflateEnd(&d->gzipStream);
+    qDeleteAll(d->waits);
+    qDeleteAll(d->sessions);
+    qDeleteAll(d->closedSessions);
     delete d;
 }
 
+/** Returns the size in bytes below which response bodies are not
+ *  compressed.
+ */
+int XmppServerBosh::compressionThreshold() const
+{
+    return d->compressionThreshold;
+}
+
+/** Sets the size in bytes below which response bodies are not compressed.
+ *
+ * A value of 0 disables compression.
+ *
+ * @param threshold
+ */
+void XmppServerBosh::setCompressionThreshold(int threshold)
+{
+    d->compressionThreshold = threshold;
+}
+
 QDjangoHttpResponse *XmppServerBosh::respondToRequest(const QDjangoHttpRequest &request)
 {
     if (request.method() == "GET") {
@@ -90,74 +818,100 @@ QDjangoHttpResponse *XmppServerBosh::respondToRequest(const QDjangoHttpRequest &
         return filterResponse(QDjangoHttpController::serveBadRequest(request));
     }
 
-    // parse XML
-    QDomDocument doc;
-    doc.setContent(request.body(), true);
-    QDomElement body = doc.documentElement();
-    if (body.tagName() != "body" || body.attribute("rid").isEmpty())
+    // parse the body element, its stanzas are read as they are processed
+    BoshBodyReader reader(request.body());
+    if (!reader.readBody())
+        return filterResponse(QDjangoHttpController::serveBadRequest(request));
+    const QDomElement body = reader.body();
+    bool ok = false;
+    const qint64 rid = body.attribute("rid").toLongLong(&ok);
+    if (!ok)
         return filterResponse(QDjangoHttpController::serveBadRequest(request));
 
     // check the session ID is correct
+    const QByteArray encoding = XmppServerHttp::acceptedEncoding(request);
     const QString sid = body.attribute("sid");
-    if (!sid.isEmpty() && !d->sessions.contains(sid))
-        return filterResponse(QDjangoHttpController::serveNotFound(request));
+    BoshSession *session = 0;
+    if (!sid.isEmpty()) {
+        session = d->sessions.value(sid);
+        if (!session)
+            return filterResponse(QDjangoHttpController::serveNotFound(request));
+    }
 
-    QXmppIncomingBosh *stream = 0;
-    if (sid.isEmpty()) {
+    if (!session) {
         // create a new session
-        stream = new QXmppIncomingBosh(server()->domain(), server());
+        QXmppIncomingBosh *stream = new QXmppIncomingBosh(server()->domain(), server());
+        const int hold = qBound(0, body.attribute("hold", "1").toInt(), maxHold);
+        stream->setHold(hold);
+        stream->setRequests(hold + 1);
         connect(stream, SIGNAL(disconnected()), this, SLOT(streamDisconnected()));
         connect(stream, SIGNAL(readyRead()), this, SLOT(writeData()));
-        d->sessions[stream->id()] = stream;
 
-        server()->addIncomingClient(stream);
-        stream->handleStream(body);
-    } else {
-        // request for an existing session
-        if (d->responses.contains(stream)) {
-            BoshResponse *old = d->responses.take(stream);
-            old->setReady(true);
-        }
+        session = new BoshSession;
+        session->stream = stream;
+        session->closed = false;
+        session->lastRid = rid;
+        d->sessions.insert(stream->id(), session);
+        d->streams.insert(stream, session);
+        d->touchSession(session);
 
-        stream = d->sessions[sid];
-        bool handled = false;
+        BoshResponse *response = d->createResponse(session, rid, encoding);
+        session->held << response;
 
-        if (body.attribute("restart") == "true") {
-            stream->handleStream(body);
-            handled = true;
-        }
+        server()->addIncomingClient(stream);
+        stream->handleStream(body);
+        if (!session->closed && d->handleStanzas(session, reader))
+            d->releaseResponses(session);
+        return filterResponse(response);
+    }
 
-        QDomElement stanza = body.firstChildElement();
-        while (!stanza.isNull()) {
-            stream->handleStanza(stanza);
-            handled = true;
-            stanza = stanza.nextSiblingElement();
+    // request for an existing session
+    d->touchSession(session);
+    if (session->sent.contains(rid)) {
+        // the client lost our response, send it again
+        QDjangoHttpResponse *response = bodyResponse(QByteArray());
+        d->setBody(response, session->sent.value(rid), encoding);
+        return response;
+    } else if (rid <= session->lastRid) {
+        BoshResponse *response = d->replaceResponse(session, rid, encoding);
+        if (response)
+            return filterResponse(response);
+
+        // the response is neither pending nor retained, the session
+        // cannot recover
+        session->stream->disconnectFromHost();
+        return terminateResponse("item-not-found");
+    } else if (rid > session->lastRid + session->stream->requests()) {
+        // the request is outside of the window
+        session->stream->disconnectFromHost();
+        return terminateResponse("item-not-found");
+    } else if (session->bodies.contains(rid)) {
+        BoshResponse *response = d->replaceResponse(session, rid, encoding);
+        if (!response) {
+            response = d->createResponse(session, rid, encoding);
+            session->waiting.insert(rid, response);
         }
-
-        // if we did not feed anything to the stream, pass it an empty
-        // element to reset the idle timer
-        if (!handled)
-            stream->handleStanza(QDomElement());
+        return filterResponse(response);
     }
 
-    // generate HTTP response
-    BoshResponse *response = new BoshResponse;
-    response->setHeader("Content-Type", "application/xml; charset=utf-8");
-    response->setReady(stream->hasPendingData());
-    response->setBody(stream->readPendingData());
-    if (!response->isReady()) {
-        connect(response, SIGNAL(destroyed(QObject*)), this, SLOT(responseDestroyed(QObject*)));
-        connect(response, SIGNAL(expired()), this, SLOT(responseExpired()));
-        QTimer::singleShot(stream->wait() * 1000, response, SIGNAL(expired()));
-        d->responses[stream] = response;
+    BoshResponse *response = d->createResponse(session, rid, encoding);
+    if (rid == session->lastRid + 1) {
+        // process the request, then those which were waiting for it
+        session->lastRid = rid;
+        session->held << response;
+        if (d->handleBody(session, reader))
+            d->processBodies(session);
+    } else {
+        // queue the request until the missing ones arrive
+        session->bodies.insert(rid, request.body());
+        session->waiting.insert(rid, response);
     }
     return filterResponse(response);
 }
 
 void XmppServerBosh::responseDestroyed(QObject *obj)
 {
-    QXmppIncomingBosh *stream = d->responses.key(static_cast<BoshResponse*>(obj));
-    d->responses.remove(stream);
+    d->removeResponse(static_cast<BoshResponse*>(obj));
 }
 
 void XmppServerBosh::responseExpired()
@@ -165,8 +919,21 @@ void XmppServerBosh::responseExpired()
     BoshResponse *response = qobject_cast<BoshResponse*>(sender());
     if (!response)
         return;
-    response->setReady(true);
-    d->responses.remove(d->responses.key(response));
+
+    BoshWait *wait = d->waits.value(response);
+    if (!wait)
+        return;
+
+    BoshSession *session = wait->session;
+    if (session->held.contains(response)) {
+        d->releaseResponse(session, response);
+    } else {
+        // the request has not been processed yet, so the stream's data
+        // belongs to earlier requests and must not be sent ahead of them
+        d->removeResponse(response);
+        d->setBody(response, QString("<body xmlns=\"%1\"/>").arg(ns_http_bind).toUtf8(), response->encoding());
+        response->setReady(true);
+    }
 }
 
 void XmppServerBosh::streamDisconnected()
@@ -174,7 +941,36 @@ void XmppServerBosh::streamDisconnected()
     QXmppIncomingBosh *stream = qobject_cast<QXmppIncomingBosh*>(sender());
     if (!stream)
         return;
+
+    BoshSession *session = d->streams.take(stream);
+    if (!session)
+        return;
     d->sessions.remove(stream->id());
+
+    // release the waiting responses
+    foreach (BoshResponse *response, session->held + session->waiting.values())
+        d->releaseResponse(session, response);
+
+    // the stream may be disconnected while the session is in use, for
+    // instance while handling a request's stanzas
+    d->wheel.stop(session);
+    session->closed = true;
+    if (d->closedSessions.isEmpty())
+        QMetaObject::invokeMethod(this, "deleteSessions", Qt::QueuedConnection);
+    d->closedSessions << session;
+}
+
+void XmppServerBosh::deleteSessions()
+{
+    qDeleteAll(d->closedSessions);
+    d->closedSessions.clear();
+}
+
+void XmppServerBosh::wheelTimeout()
+{
+    d->wheel.advance();
+    if (d->wheel.isEmpty())
+        d->wheelTimer->stop();
 }
 
 void XmppServerBosh::writeData()
@@ -183,13 +979,9 @@ void XmppServerBosh::writeData()
     if (!stream)
         return;
 
-    BoshResponse *response = d->responses.value(stream);
-    if (!response)
-        return;
-
-    response->setBody(stream->readPendingData());
-    response->setReady(true);
-    d->responses.remove(stream);
+    BoshSession *session = d->streams.value(stream);
+    if (session)
+        d->releaseResponses(session);
 }
 
 bool XmppServerBosh::start()
@@ -31,37 +31,50 @@ class BoshResponse : public QDjangoHttpResponse
     Q_OBJECT
 
 public:
-    BoshResponse();
+    BoshResponse(qint64 rid);
     bool isReady() const;
     void setReady(bool ready);
+    qint64 rid() const;
+
+    QByteArray encoding() const;
+    void setEncoding(const QByteArray &encoding);
 
 signals:
     void expired();
 
 private:
+    QByteArray m_encoding;
     bool m_ready;
+    qint64 m_rid;
 };
 
 class XmppServerBosh : public QXmppServerExtension
 {
     Q_OBJECT
     Q_CLASSINFO("ExtensionName", "bosh");
+    Q_PROPERTY(int compressionThreshold READ compressionThreshold WRITE setCompressionThreshold);
 
 public:
     XmppServerBosh();
     ~XmppServerBosh();
 
+    int compressionThreshold() const;
+    void setCompressionThreshold(int threshold);
+
     bool start();
 
 private slots:
+    void deleteSessions();
     QDjangoHttpResponse *respondToRequest(const QDjangoHttpRequest &request);
     void responseDestroyed(QObject *obj);
     void responseExpired();
     void streamDisconnected();
+    void wheelTimeout();
     void writeData();
 
 private:
     XmppServerBoshPrivate * const d;
+    friend class XmppServerBoshPrivate;
 };
 
 #endif
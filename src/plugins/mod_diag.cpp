@@ -353,7 +353,10 @@ bool XmppServerDiag::start()
     // add HTTP interface
     QDjangoUrlResolver *urls = server()->findChild<QDjangoUrlResolver*>();
     if (urls) {
-        urls->set(QRegExp("^speed/$"), this, "serveSpeed");
+        // the speed test needs no state, so it can be served off the
+        // main thread
+        QDjangoUrlResolver *threadedUrls = server()->findChild<QDjangoUrlResolver*>("threaded");
+        (threadedUrls ? threadedUrls : urls)->set(QRegExp("^speed/$"), this, "serveSpeed");
         if (d->httpAdminEnabled) {
             urls->set(QRegExp("^diagnostics/nodes/$"), this, "serveNodeList");
             urls->set(QRegExp("^diagnostics/nodes/(.+)$"), this, "serveNodeDetail");
@@ -17,10 +17,24 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <QAtomicInteger>
+#include <QCache>
+#include <QDateTime>
 #include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
 #include <QFileInfo>
+#include <QFileSystemWatcher>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
 #include <QRegExp>
 #include <QStringList>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
 
 #include "QDjangoHttpController.h"
 #include "QDjangoHttpRequest.h"
@@ -28,46 +42,1128 @@
 #include "QDjangoHttpServer.h"
 #include "QDjangoUrlResolver.h"
 
+// QDjango has no public API to serve a connection which was accepted
+// elsewhere, so the worker threads rely on its private connection class
+// and are only available if its private headers are installed
+#ifdef HAVE_QDJANGO_HTTP_PRIVATE
+#include "QDjangoHttpServer_p.h"
+#endif
+
 #include "QXmppServer.h"
 #include "QXmppServerPlugin.h"
 
 #include "mod_http.h"
 
+// size of the reads used to serve files which are not cached
+static const qint64 fileChunkSize = 65536;
+
+// largest part of a file served in one response, a response body is a
+// QByteArray which cannot reach 2 GiB
+static const qint64 maxBodySize = 1024 * 1024 * 1024;
+
+/** Reads \a size bytes at \a offset from the given file.
+ *
+ *  The file is read in chunks into a single buffer, unlike a memory map
+ *  this is safe if the file is truncated while it is being served.
+ */
+static QByteArray readFile(const QString &filePath, qint64 offset, qint64 size)
+{
+    QFile file(filePath);
+    if (size <= 0 || size > maxBodySize || !file.open(QIODevice::ReadOnly) || !file.seek(offset))
+        return QByteArray();
+
+    QByteArray data;
+    data.resize(size);
+    qint64 pos = 0;
+    while (pos < size) {
+        const qint64 count = file.read(data.data() + pos, qMin(fileChunkSize, size - pos));
+        if (count <= 0)
+            break;
+        pos += count;
+    }
+    data.resize(pos);
+    return data;
+}
+
+/** Returns the MIME type to use for the given file.
+ */
+static QString mimeType(const QString &filePath)
+{
+    const QString suffix = QFileInfo(filePath).suffix().toLower();
+    if (suffix == "html" || suffix == "htm")
+        return "text/html; charset=utf-8";
+    else if (suffix == "css")
+        return "text/css; charset=utf-8";
+    else if (suffix == "js")
+        return "application/javascript; charset=utf-8";
+    else if (suffix == "json" || suffix == "map")
+        return "application/json";
+    else if (suffix == "txt")
+        return "text/plain; charset=utf-8";
+    else if (suffix == "xml")
+        return "application/xml";
+    else if (suffix == "png")
+        return "image/png";
+    else if (suffix == "jpg" || suffix == "jpeg")
+        return "image/jpeg";
+    else if (suffix == "gif")
+        return "image/gif";
+    else if (suffix == "svg")
+        return "image/svg+xml";
+    else if (suffix == "ico")
+        return "image/x-icon";
+    else if (suffix == "woff")
+        return "font/woff";
+    else if (suffix == "woff2")
+        return "font/woff2";
+    else
+        return "application/octet-stream";
+}
+
+/** Parses a single byte range from a Range header.
+ *
+ * Returns false if the header should be ignored, and sets \a start to
+ * -1 if the range cannot be satisfied.
+ */
+static bool parseRange(const QString &header, qint64 size, qint64 &start, qint64 &end)
+{
+    QRegExp rx("^bytes=(\\d*)-(\\d*)$");
+    if (!rx.exactMatch(header.trimmed()) || (rx.cap(1).isEmpty() && rx.cap(2).isEmpty()))
+        return false;
+
+    if (rx.cap(1).isEmpty()) {
+        // suffix range
+        const qint64 length = rx.cap(2).toLongLong();
+        start = length ? qMax(qint64(0), size - length) : -1;
+        end = size - 1;
+    } else {
+        start = rx.cap(1).toLongLong();
+        end = size - 1;
+        if (!rx.cap(2).isEmpty()) {
+            if (rx.cap(2).toLongLong() < start)
+                return false;
+            end = qMin(rx.cap(2).toLongLong(), end);
+        }
+        if (start >= size)
+            start = -1;
+    }
+    return true;
+}
+
+/** One representation of a static file, with its precomputed headers.
+ */
+struct StaticVariant
+{
+    bool isCurrent(const QFileInfo &info) const;
+    bool isValid() const;
+    bool load(const QFileInfo &info, qint64 maxSize);
+
+    QString filePath;
+    qint64 size;
+    QDateTime modified;
+    QString etag;
+    QString lastModified;
+
+    // the file's contents, if they are cached
+    QByteArray data;
+};
+
+/** Returns true if the given file still has the size and modification
+ *  time which were loaded.
+ */
+bool StaticVariant::isCurrent(const QFileInfo &info) const
+{
+    return info.isFile() && info.size() == size && info.lastModified().toUTC() == modified;
+}
+
+bool StaticVariant::isValid() const
+{
+    return !filePath.isEmpty();
+}
+
+/** Fills in the headers for the given file, and reads its contents
+ *  unless it is larger than \a maxSize bytes.
+ */
+bool StaticVariant::load(const QFileInfo &info, qint64 maxSize)
+{
+    if (!info.isFile() || !info.isReadable())
+        return false;
+
+    modified = info.lastModified().toUTC();
+    filePath = info.filePath();
+    size = info.size();
+    lastModified = QDjangoHttpController::httpDateTime(modified);
+    etag = QString("\"%1-%2%3\"").arg(
+        QString::number(size, 16),
+        QString::number(modified.toMSecsSinceEpoch(), 16),
+        filePath.endsWith(".gz") ? QLatin1String("-gz") : QLatin1String(""));
+
+    if (size <= maxSize) {
+        QFile file(filePath);
+        if (!file.open(QIODevice::ReadOnly))
+            return false;
+        data = file.readAll();
+        if (data.size() != size)
+            return false;
+    }
+    return true;
+}
+
+/** A static file, with its raw and precompressed representations.
+ */
+class StaticAsset
+{
+public:
+    bool isCacheable() const;
+    bool isCurrent(const QString &filePath) const;
+    bool load(const QString &filePath, qint64 maxSize);
+
+    QString contentType;
+    StaticVariant raw;
+    StaticVariant gzip;
+};
+
+/** Returns true if the contents of all representations were read.
+ */
+bool StaticAsset::isCacheable() const
+{
+    return !raw.data.isNull() && (!gzip.isValid() || !gzip.data.isNull());
+}
+
+/** Returns true if loading the given file again would give the same
+ *  representations.
+ */
+bool StaticAsset::isCurrent(const QString &filePath) const
+{
+    const QFileInfo info(filePath);
+    if (!raw.isCurrent(info))
+        return false;
+
+    const QFileInfo gzInfo(filePath + ".gz");
+    if (gzip.isValid())
+        return gzip.isCurrent(gzInfo);
+    return !gzInfo.exists() || gzInfo.lastModified() < info.lastModified();
+}
+
+bool StaticAsset::load(const QString &filePath, qint64 maxSize)
+{
+    const QFileInfo info(filePath);
+    if (!raw.load(info, maxSize))
+        return false;
+
+    const QFileInfo gzInfo(filePath + ".gz");
+    if (gzInfo.exists() && gzInfo.lastModified() >= info.lastModified() && !gzip.load(gzInfo, maxSize))
+        gzip = StaticVariant();
+
+    contentType = mimeType(filePath);
+    return true;
+}
+
+/** A static file held in the cache, whose files are watched for changes.
+ */
+class CachedStaticAsset : public StaticAsset
+{
+public:
+    CachedStaticAsset(const StaticAsset &asset, QObject *owner);
+    ~CachedStaticAsset();
+
+private:
+    QObject *m_owner;
+};
+
+CachedStaticAsset::CachedStaticAsset(const StaticAsset &asset, QObject *owner)
+    : StaticAsset(asset)
+    , m_owner(owner)
+{
+}
+
+CachedStaticAsset::~CachedStaticAsset()
+{
+    // stop watching the files once they leave the cache, the watcher
+    // lives in the main thread
+    QStringList paths;
+    paths << raw.filePath;
+    if (gzip.isValid())
+        paths << gzip.filePath;
+    QMetaObject::invokeMethod(m_owner, "_q_staticUnwatch", Qt::QueuedConnection, Q_ARG(QString, raw.filePath), Q_ARG(QStringList, paths));
+}
+
+// number of access log records which can be pending
+static const int accessLogCapacity = 8192;
+
+// time for which access log records are gathered before they are
+// written out, in milliseconds
+static const int accessLogInterval = 200;
+
+/** An HTTP access log record.
+ */
+struct AccessRecord
+{
+    qint64 time;
+    QString method;
+    QString path;
+    int status;
+    qint64 size;
+    qint64 duration;
+    QString referer;
+    QString userAgent;
+    int sampleRate;
+};
+
+class AccessLogWriter;
+
+/** A lock-free queue of access log records, with a single producer
+ *  (the thread serving requests) and a single consumer (the writer).
+ */
+class AccessLogQueue
+{
+public:
+    AccessLogQueue(int capacity, AccessLogWriter *writer);
+
+    bool push(const AccessRecord &record);
+    bool pop(AccessRecord &record);
+
+private:
+    QVector<AccessRecord> m_records;
+    quint32 m_mask;
+    QAtomicInteger<quint32> m_head;
+    QAtomicInteger<quint32> m_tail;
+    AccessLogWriter *m_writer;
+};
+
+/** Constructs a queue, \a capacity must be a power of two.
+ */
+AccessLogQueue::AccessLogQueue(int capacity, AccessLogWriter *writer)
+    : m_records(capacity)
+    , m_mask(capacity - 1)
+    , m_head(0)
+    , m_tail(0)
+    , m_writer(writer)
+{
+    Q_ASSERT((capacity & (capacity - 1)) == 0);
+}
+
+/** Takes the oldest record, returns false if the queue is empty.
+ */
+bool AccessLogQueue::pop(AccessRecord &record)
+{
+    const quint32 head = m_head.load();
+    if (head == m_tail.loadAcquire())
+        return false;
+
+    // release the slot's strings from this thread
+    AccessRecord &slot = m_records[head & m_mask];
+    record = slot;
+    slot = AccessRecord();
+    m_head.storeRelease(head + 1);
+    return true;
+}
+
+/** A thread which formats the queued access log records as JSON lines
+ *  and appends them to the access log file.
+ *
+ * The thread sleeps until records are queued, then gathers them for a
+ * short while so that they are written out together.
+ */
+class AccessLogWriter : public QThread
+{
+public:
+    AccessLogWriter(const QString &fileName, QObject *parent = 0);
+    ~AccessLogWriter();
+
+    AccessLogQueue *createQueue();
+    void notify();
+    void reopen();
+    void stop();
+
+protected:
+    void run();
+
+private:
+    void flush(QFile &file);
+
+    QString m_fileName;
+    QList<AccessLogQueue*> m_queues;
+
+    // set when records were queued since the last flush, so that only
+    // the first of them wakes the writer up
+    QAtomicInt m_pending;
+
+    // protected by m_mutex
+    QMutex m_mutex;
+    QWaitCondition m_wakeup;
+    bool m_reopen;
+    bool m_stop;
+};
+
+/** Appends a record, returns false if the queue is full.
+ */
+bool AccessLogQueue::push(const AccessRecord &record)
+{
+    const quint32 tail = m_tail.load();
+    if (tail - m_head.loadAcquire() > m_mask)
+        return false;
+
+    m_records[tail & m_mask] = record;
+    m_tail.storeRelease(tail + 1);
+    m_writer->notify();
+    return true;
+}
+
+AccessLogWriter::AccessLogWriter(const QString &fileName, QObject *parent)
+    : QThread(parent)
+    , m_fileName(fileName)
+    , m_pending(0)
+    , m_reopen(false)
+    , m_stop(false)
+{
+}
+
+AccessLogWriter::~AccessLogWriter()
+{
+    qDeleteAll(m_queues);
+}
+
+/** Creates a queue for a thread serving requests, this must be called
+ *  before the writer is started.
+ */
+AccessLogQueue *AccessLogWriter::createQueue()
+{
+    Q_ASSERT(!isRunning());
+    AccessLogQueue *queue = new AccessLogQueue(accessLogCapacity, this);
+    m_queues << queue;
+    return queue;
+}
+
+/** Wakes the writer up after a record was queued.
+ */
+void AccessLogWriter::notify()
+{
+    if (!m_pending.fetchAndStoreRelease(1)) {
+        QMutexLocker locker(&m_mutex);
+        m_wakeup.wakeOne();
+    }
+}
+
+/** Asks the writer to reopen the file, for instance after it was rotated.
+ */
+void AccessLogWriter::reopen()
+{
+    QMutexLocker locker(&m_mutex);
+    m_reopen = true;
+    m_wakeup.wakeOne();
+}
+
+/** Writes out the pending records and stops the thread.
+ */
+void AccessLogWriter::stop()
+{
+    m_mutex.lock();
+    m_stop = true;
+    m_wakeup.wakeOne();
+    m_mutex.unlock();
+    wait();
+}
+
+void AccessLogWriter::flush(QFile &file)
+{
+    QByteArray data;
+    AccessRecord record;
+    foreach (AccessLogQueue *queue, m_queues) {
+        while (queue->pop(record)) {
+            QJsonObject object;
+            object.insert("time", QDateTime::fromMSecsSinceEpoch(record.time).toUTC().toString(Qt::ISODate));
+            object.insert("method", record.method);
+            object.insert("path", record.path);
+            object.insert("status", record.status);
+            object.insert("size", record.size);
+            object.insert("duration_us", record.duration);
+            if (!record.referer.isEmpty())
+                object.insert("referer", record.referer);
+            if (!record.userAgent.isEmpty())
+                object.insert("user_agent", record.userAgent);
+            if (record.sampleRate > 1)
+                object.insert("sample_rate", record.sampleRate);
+            data += QJsonDocument(object).toJson(QJsonDocument::Compact);
+            data += '\n';
+        }
+    }
+    if (!data.isEmpty() && file.isOpen()) {
+        file.write(data);
+        file.flush();
+    }
+}
+
+void AccessLogWriter::run()
+{
+    QFile file(m_fileName);
+    file.open(QIODevice::WriteOnly | QIODevice::Append);
+
+    m_mutex.lock();
+    while (!m_stop) {
+        if (!m_pending.loadAcquire() && !m_reopen) {
+            m_wakeup.wait(&m_mutex);
+            continue;
+        }
+
+        // gather the records which follow, unless asked to stop
+        if (!m_reopen)
+            m_wakeup.wait(&m_mutex, accessLogInterval);
+
+        const bool reopen = m_reopen;
+        m_reopen = false;
+        m_pending.fetchAndStoreAcquire(0);
+        m_mutex.unlock();
+
+        if (reopen) {
+            file.close();
+            file.open(QIODevice::WriteOnly | QIODevice::Append);
+        }
+        flush(file);
+        m_mutex.lock();
+    }
+    m_mutex.unlock();
+    flush(file);
+}
+
+// meta data which is copied to the requests handled on the main thread
+static const char *forwardedMeta[] = {
+    "CONTENT_LENGTH",
+    "CONTENT_TYPE",
+    "HTTP_ACCEPT",
+    "HTTP_ACCEPT_ENCODING",
+    "HTTP_ACCEPT_LANGUAGE",
+    "HTTP_AUTHORIZATION",
+    "HTTP_COOKIE",
+    "HTTP_HOST",
+    "HTTP_ORIGIN",
+    "HTTP_REFERER",
+    "HTTP_USER_AGENT",
+    "HTTP_X_FORWARDED_FOR",
+    "QUERY_STRING",
+    "REMOTE_ADDR",
+    0
+};
+
+// headers which are copied from the responses built on the main thread
+static const char *forwardedHeaders[] = {
+    "Access-Control-Allow-Headers",
+    "Access-Control-Allow-Methods",
+    "Access-Control-Allow-Origin",
+    "Cache-Control",
+    "Content-Encoding",
+    "Content-Type",
+    "Expires",
+    "Last-Modified",
+    "Location",
+    "Vary",
+    "WWW-Authenticate",
+    0
+};
+
+/** A response served by a worker thread on behalf of a handler which
+ *  runs on the main thread.
+ */
+class ForwardedResponse : public QDjangoHttpResponse
+{
+public:
+    ForwardedResponse(QObject *http, QObject *worker, quint64 id);
+    ~ForwardedResponse();
+
+    bool isReady() const;
+    void complete();
+
+private:
+    QObject *m_http;
+    QObject *m_worker;
+    quint64 m_id;
+    bool m_ready;
+};
+
+ForwardedResponse::ForwardedResponse(QObject *http, QObject *worker, quint64 id)
+    : m_http(http)
+    , m_worker(worker)
+    , m_id(id)
+    , m_ready(false)
+{
+}
+
+ForwardedResponse::~ForwardedResponse()
+{
+    // the client went away, the handler can drop its response
+    if (!m_ready)
+        QMetaObject::invokeMethod(m_http, "_q_forwardCancelled", Qt::QueuedConnection,
+            Q_ARG(QObject*, m_worker),
+            Q_ARG(quint64, m_id));
+}
+
+bool ForwardedResponse::isReady() const
+{
+    return m_ready;
+}
+
+void ForwardedResponse::complete()
+{
+    m_ready = true;
+    emit ready();
+}
+
+/** A request handled on the main thread on behalf of a worker thread.
+ */
+struct ForwardedRequest
+{
+    QDjangoHttpRequest *request;
+    QObject *worker;
+    quint64 id;
+};
+
 class XmppServerHttpPrivate
 {
 public:
+    void addConnection(qintptr descriptor);
+    void completeForward(QDjangoHttpResponse *response);
+    void dropForward(QDjangoHttpResponse *response);
+    void logRequest(const AccessRecord &record);
+    QDjangoHttpResponse *respondThreaded(const QDjangoHttpRequest &request, const QString &path);
+    QDjangoHttpResponse *serveFile(const QDjangoHttpRequest &request, const QString &filePath);
+
     QDjangoHttpServer *httpServer;
+    HttpWorker *mainWorker;
+    QDjangoUrlResolver *urls;
+
+    // handlers which can run on the worker threads, they must be safe to
+    // call from any thread and are only registered while the server
+    // starts, before any connection is handed to the workers
+    QDjangoUrlResolver *threadedUrls;
+
+    // worker threads, used if "threads" is set
+    QTcpServer *listener;
+    QList<HttpWorker*> workers;
+    QList<QThread*> workerThreads;
+
+    // responses built on the main thread for the worker threads
+    QHash<QDjangoHttpResponse*, ForwardedRequest> forwards;
+
+    // access log
+    AccessLogWriter *accessLogWriter;
+
+    // cache of small static files, its cost is in bytes
+    QCache<QString, CachedStaticAsset> staticCache;
+    QMutex staticMutex;
+    QFileSystemWatcher *staticWatcher;
+
+    // number of cached files in each watched directory, only used from
+    // the main thread
+    QHash<QString, int> staticDirectories;
 
     // config
+    QString accessLog;
+    QStringList accessLogSamplePaths;
+    int accessLogSampleRate;
     QString host;
     quint16 port;
+    bool staticGzip;
     QString staticRoot;
     QString staticUrl;
+    int threads;
+    XmppServerHttp *q;
 };
 
+/** Hands a new connection to the least loaded worker thread.
+ */
+void XmppServerHttpPrivate::addConnection(qintptr descriptor)
+{
+    HttpWorker *worker = 0;
+    foreach (HttpWorker *candidate, workers) {
+        if (!worker || candidate->connectionCount() < worker->connectionCount())
+            worker = candidate;
+    }
+    worker->reserveConnection();
+    QMetaObject::invokeMethod(worker, "addConnection", Qt::QueuedConnection, Q_ARG(qintptr, descriptor));
+}
+
+/** Sends a response built on the main thread to the worker thread which
+ *  is serving the request.
+ */
+void XmppServerHttpPrivate::completeForward(QDjangoHttpResponse *response)
+{
+    const ForwardedRequest forward = forwards.take(response);
+    delete forward.request;
+
+    QVariantHash headers;
+    for (int i = 0; forwardedHeaders[i]; ++i) {
+        const QString value = response->header(forwardedHeaders[i]);
+        if (!value.isEmpty())
+            headers.insert(forwardedHeaders[i], value);
+    }
+    QMetaObject::invokeMethod(forward.worker, "_q_complete", Qt::QueuedConnection,
+        Q_ARG(quint64, forward.id),
+        Q_ARG(int, response->statusCode()),
+        Q_ARG(QString, response->reasonPhrase()),
+        Q_ARG(QByteArray, response->body()),
+        Q_ARG(QVariantHash, headers));
+
+    QObject::disconnect(response, 0, q, 0);
+    response->deleteLater();
+}
+
+/** Drops a response built on the main thread which is no longer needed.
+ */
+void XmppServerHttpPrivate::dropForward(QDjangoHttpResponse *response)
+{
+    delete forwards.take(response).request;
+    QObject::disconnect(response, 0, q, 0);
+    response->deleteLater();
+}
+
+/** Logs a request through the server's logger, for when there is no
+ *  access log file.
+ */
+void XmppServerHttpPrivate::logRequest(const AccessRecord &record)
+{
+    q->info(QString("HTTP request \"%1 %2 HTTP/%3\" %4 %5 \"%6\" \"%7\" %8us").arg(
+        record.method,
+        record.path,
+        QLatin1String("1.1"),
+        QString::number(record.status),
+        QString::number(record.size),
+        record.referer.isEmpty() ? QLatin1String("-") : record.referer,
+        record.userAgent.isEmpty() ? QLatin1String("-") : record.userAgent,
+        QString::number(record.duration)));
+}
+
+/** Runs the handlers which do not need the main thread.
+ *
+ * Returns 0 if none of them serves the given path.
+ */
+QDjangoHttpResponse *XmppServerHttpPrivate::respondThreaded(const QDjangoHttpRequest &request, const QString &path)
+{
+    QDjangoHttpResponse *response = threadedUrls->respond(request, path);
+    if (response->statusCode() == QDjangoHttpResponse::NotFound) {
+        delete response;
+        return 0;
+    }
+    return response;
+}
+
+/** Serves a static file, honouring conditional and range requests and
+ *  using a precompressed ".gz" sibling if the client accepts it.
+ *
+ * Small files are served from memory, larger ones are read from disk.
+ */
+QDjangoHttpResponse *XmppServerHttpPrivate::serveFile(const QDjangoHttpRequest &request, const QString &filePath)
+{
+    // the lock is only held to access the cache, copying an asset only
+    // references its contents
+    StaticAsset asset;
+    bool cached = false;
+    int maxCost;
+    {
+        QMutexLocker locker(&staticMutex);
+        const CachedStaticAsset *entry = staticCache.object(filePath);
+        if (entry) {
+            asset = *entry;
+            cached = true;
+        }
+        maxCost = staticCache.maxCost();
+    }
+
+    if (cached) {
+        q->updateCounter("http.static.cache.hit");
+    } else {
+        q->updateCounter("http.static.cache.miss");
+
+        // files which would take more than an eighth of the cache are
+        // not worth evicting everything else for
+        if (!asset.load(filePath, maxCost / 8))
+            return QDjangoHttpController::serveNotFound(request);
+        if (asset.isCacheable()) {
+            QStringList paths;
+            paths << asset.raw.filePath;
+            if (asset.gzip.isValid())
+                paths << asset.gzip.filePath;
+
+            QMutexLocker locker(&staticMutex);
+            staticCache.insert(filePath, new CachedStaticAsset(asset, q), asset.raw.data.size() + asset.gzip.data.size());
+            QMetaObject::invokeMethod(q, "_q_staticWatch", Qt::QueuedConnection, Q_ARG(QString, filePath), Q_ARG(QStringList, paths));
+            q->setGauge("http.static.cache.bytes", staticCache.totalCost());
+        }
+    }
+
+    // pick the representation
+    const bool useGzip = staticGzip && asset.gzip.isValid() && XmppServerHttp::acceptedEncoding(request) == "gzip";
+    const StaticVariant &variant = useGzip ? asset.gzip : asset.raw;
+
+    // check whether the client's copy is still valid
+    bool notModified = false;
+    const QString ifNoneMatch = request.meta("HTTP_IF_NONE_MATCH");
+    if (!ifNoneMatch.isEmpty()) {
+        foreach (const QString &tag, ifNoneMatch.split(',')) {
+            const QString trimmed = tag.trimmed();
+            if (trimmed == "*" || trimmed == variant.etag || trimmed == "W/" + variant.etag)
+                notModified = true;
+        }
+    } else {
+        const QDateTime since = QDjangoHttpController::httpDateTime(request.meta("HTTP_IF_MODIFIED_SINCE"));
+        if (since.isValid() && since.toTime_t() >= variant.modified.toTime_t())
+            notModified = true;
+    }
+
+    QDjangoHttpResponse *response;
+    if (notModified) {
+        response = new QDjangoHttpResponse;
+        response->setStatusCode(QDjangoHttpResponse::NotModified);
+    } else {
+        // check for a range request, unless If-Range says the file changed
+        qint64 start = 0;
+        qint64 end = variant.size - 1;
+        const QString ifRange = request.meta("HTTP_IF_RANGE");
+        const bool rangeValid = ifRange.isEmpty() || ifRange == variant.etag || ifRange == variant.lastModified;
+        const QString range = request.meta("HTTP_RANGE");
+        const bool partial = !range.isEmpty() && rangeValid && parseRange(range, variant.size, start, end);
+        if (partial && start < 0) {
+            response = new QDjangoHttpResponse;
+            response->setStatusCode(416);
+            response->setReasonPhrase("Requested Range Not Satisfiable");
+            response->setHeader("Content-Range", QString("bytes */%1").arg(variant.size));
+            return response;
+        }
+
+        // larger ranges are cut short, the client asks for the rest
+        if (partial && end - start + 1 > maxBodySize)
+            end = start + maxBodySize - 1;
+
+        const qint64 length = end - start + 1;
+        if (length > maxBodySize) {
+            q->warning(QString("Static file %1 is too large to be served whole").arg(variant.filePath));
+            response = new QDjangoHttpResponse;
+            response->setStatusCode(QDjangoHttpResponse::InternalServerError);
+            return response;
+        } else if (!variant.data.isNull()) {
+            response = new QDjangoHttpResponse;
+            response->setBody(variant.data.mid(start, length));
+            q->updateCounter("http.static.cache.served", length);
+        } else {
+            response = new QDjangoHttpResponse;
+            response->setBody(readFile(variant.filePath, start, length));
+        }
+        if (partial) {
+            response->setStatusCode(206);
+            response->setReasonPhrase("Partial Content");
+            response->setHeader("Content-Range", QString("bytes %1-%2/%3").arg(
+                QString::number(start),
+                QString::number(end),
+                QString::number(variant.size)));
+        }
+    }
+
+    response->setHeader("Accept-Ranges", "bytes");
+    response->setHeader("Content-Type", asset.contentType);
+    response->setHeader("ETag", variant.etag);
+    response->setHeader("Last-Modified", variant.lastModified);
+    if (useGzip)
+        response->setHeader("Content-Encoding", "gzip");
+    if (staticGzip)
+        response->setHeader("Vary", "Accept-Encoding");
+    return response;
+}
+
+/** A listener which hands the connections it accepts to the worker
+ *  threads.
+ */
+class HttpListener : public QTcpServer
+{
+public:
+    HttpListener(XmppServerHttpPrivate *http);
+
+protected:
+    void incomingConnection(qintptr descriptor);
+
+private:
+    XmppServerHttpPrivate *m_http;
+};
+
+HttpListener::HttpListener(XmppServerHttpPrivate *http)
+    : m_http(http)
+{
+}
+
+void HttpListener::incomingConnection(qintptr descriptor)
+{
+    m_http->addConnection(descriptor);
+}
+
+HttpWorker::HttpWorker(XmppServerHttpPrivate *http, QObject *parent)
+    : QObject(parent)
+    , m_http(http)
+    , m_connections(0)
+    , m_lastForward(0)
+    , m_logQueue(0)
+    , m_logSampleCount(0)
+{
+    bool check;
+    Q_UNUSED(check);
+
+    m_clock.start();
+    m_server = new QDjangoHttpServer(this);
+    m_server->urls()->set(QRegExp("^(.*)$"), this, "_q_dispatch");
+
+    check = connect(m_server, SIGNAL(requestFinished(QDjangoHttpRequest*,QDjangoHttpResponse*)),
+                    this, SLOT(_q_requestFinished(QDjangoHttpRequest*,QDjangoHttpResponse*)));
+    Q_ASSERT(check);
+}
+
+/** Returns the number of connections served by this worker.
+ */
+int HttpWorker::connectionCount() const
+{
+    return m_connections.load();
+}
+
+/** Counts a connection which is about to be handed to this worker.
+ */
+void HttpWorker::reserveConnection()
+{
+    m_connections.ref();
+}
+
+QDjangoHttpServer *HttpWorker::server() const
+{
+    return m_server;
+}
+
+void HttpWorker::setLogQueue(AccessLogQueue *queue)
+{
+    m_logQueue = queue;
+}
+
+void HttpWorker::addConnection(qintptr descriptor)
+{
+#ifdef HAVE_QDJANGO_HTTP_PRIVATE
+    bool check;
+    Q_UNUSED(check);
+
+    QTcpSocket *socket = new QTcpSocket;
+    if (!socket->setSocketDescriptor(descriptor)) {
+        delete socket;
+        m_connections.deref();
+        return;
+    }
+
+    QDjangoHttpConnection *connection = new QDjangoHttpConnection(socket, m_server);
+    check = connect(connection, SIGNAL(closed()),
+                    this, SLOT(_q_connectionClosed()));
+    Q_ASSERT(check);
+
+    check = connect(connection, SIGNAL(requestFinished(QDjangoHttpRequest*,QDjangoHttpResponse*)),
+                    this, SLOT(_q_requestFinished(QDjangoHttpRequest*,QDjangoHttpResponse*)));
+    Q_ASSERT(check);
+#else
+    Q_UNUSED(descriptor);
+#endif
+}
+
+void HttpWorker::_q_complete(quint64 id, int statusCode, const QString &reasonPhrase, const QByteArray &body, const QVariantHash &headers)
+{
+    // the client may have gone away in the meantime
+    ForwardedResponse *response = static_cast<ForwardedResponse*>(m_forwards.take(id).data());
+    if (!response)
+        return;
+
+    response->setStatusCode(statusCode);
+    response->setReasonPhrase(reasonPhrase);
+    foreach (const QString &key, headers.keys())
+        response->setHeader(key, headers.value(key).toString());
+    response->setBody(body);
+    response->complete();
+}
+
+void HttpWorker::_q_connectionClosed()
+{
+    QObject *connection = sender();
+    if (connection) {
+        connection->deleteLater();
+        m_connections.deref();
+    }
+}
+
+QDjangoHttpResponse *HttpWorker::_q_dispatch(const QDjangoHttpRequest &request, const QString &path)
+{
+    // the start time is kept on the response, which is deleted along
+    // with the connection even if the request never finishes
+    const qint64 started = m_clock.nsecsElapsed();
+
+    QDjangoHttpResponse *response = m_http->respondThreaded(request, path);
+    if (!response && thread() == m_http->q->thread())
+        response = m_http->urls->respond(request, path);
+    if (response) {
+        response->setProperty("__http_started", started);
+        return response;
+    }
+
+    // the handler needs the main thread, it gets a copy of the request
+    // and this thread carries on serving other connections
+    QVariantHash meta;
+    for (int i = 0; forwardedMeta[i]; ++i) {
+        const QString value = request.meta(forwardedMeta[i]);
+        if (!value.isEmpty())
+            meta.insert(forwardedMeta[i], value);
+    }
+
+    const quint64 id = ++m_lastForward;
+    response = new ForwardedResponse(m_http->q, this, id);
+    response->setProperty("__http_started", started);
+    m_forwards.insert(id, response);
+    QMetaObject::invokeMethod(m_http->q, "_q_forward", Qt::QueuedConnection,
+        Q_ARG(QString, request.method()),
+        Q_ARG(QString, request.path()),
+        Q_ARG(QVariantHash, meta),
+        Q_ARG(QByteArray, request.body()),
+        Q_ARG(QString, path),
+        Q_ARG(QObject*, this),
+        Q_ARG(quint64, id));
+    return response;
+}
+
+void HttpWorker::_q_requestFinished(QDjangoHttpRequest *request, QDjangoHttpResponse *response)
+{
+    const QVariant started = response->property("__http_started");
+    const qint64 duration = started.isValid() ? (m_clock.nsecsElapsed() - started.toLongLong()) / 1000 : 0;
+
+    // only log some of the successful requests to high-volume paths
+    int sampleRate = 1;
+    if (m_http->accessLogSampleRate > 1 && response->statusCode() < 400) {
+        foreach (const QString &prefix, m_http->accessLogSamplePaths) {
+            if (request->path().startsWith(prefix)) {
+                if (m_logSampleCount++ % m_http->accessLogSampleRate)
+                    return;
+                sampleRate = m_http->accessLogSampleRate;
+                break;
+            }
+        }
+    }
+
+    AccessRecord record;
+    record.time = QDateTime::currentMSecsSinceEpoch();
+    record.method = request->method();
+    record.path = request->path();
+    record.status = response->statusCode();
+    record.size = response->body().size();
+    record.duration = duration;
+    record.referer = request->meta("HTTP_REFERER");
+    record.userAgent = request->meta("HTTP_USER_AGENT");
+    record.sampleRate = sampleRate;
+
+    if (!m_logQueue)
+        m_http->logRequest(record);
+    else if (!m_logQueue->push(record))
+        m_http->q->updateCounter("http.log.dropped");
+}
+
 XmppServerHttp::XmppServerHttp()
     : d(new XmppServerHttpPrivate)
 {
     bool check;
     Q_UNUSED(check);
 
+    qRegisterMetaType<qintptr>("qintptr");
+
+    d->q = this;
+    d->accessLogSamplePaths << "/http-bind/";
+    d->accessLogSampleRate = 1;
+    d->accessLogWriter = 0;
+    d->listener = 0;
+    d->staticCache.setMaxCost(16 * 1024 * 1024);
+    d->staticGzip = true;
     d->staticRoot = "/var/lib/xmpp-share-server/public";
     d->staticUrl = "/static/";
-    d->httpServer = new QDjangoHttpServer(this);
+    d->staticWatcher = new QFileSystemWatcher(this);
+    d->threads = 0;
+    d->mainWorker = new HttpWorker(d, this);
+    d->httpServer = d->mainWorker->server();
+
+    // extensions look up the first QDjangoUrlResolver below the server,
+    // which is this one as it is a direct child of the extension
+    d->urls = new QDjangoUrlResolver(this);
+
+    d->threadedUrls = new QDjangoUrlResolver(this);
+    d->threadedUrls->setObjectName("threaded");
 
     d->host = "0.0.0.0";
     d->port = 5280;
 
-    check = connect(d->httpServer, SIGNAL(requestFinished(QDjangoHttpRequest*,QDjangoHttpResponse*)),
-                    this, SLOT(_q_requestFinished(QDjangoHttpRequest*,QDjangoHttpResponse*)));
+    check = connect(d->staticWatcher, SIGNAL(fileChanged(QString)),
+                    this, SLOT(_q_staticChanged(QString)));
+    Q_ASSERT(check);
+
+    check = connect(d->staticWatcher, SIGNAL(directoryChanged(QString)),
+                    this, SLOT(_q_staticChanged(QString)));
     Q_ASSERT(check);
 }
 
 XmppServerHttp::~XmppServerHttp()
 {
+    if (d->accessLogWriter)
+        d->accessLogWriter->stop();
+    d->staticCache.clear();
     delete d;
 }
 
+/** Returns the content coding to use for the response to \a request,
+ *  based on its Accept-Encoding header: "gzip", "deflate" or none.
+ */
+QByteArray XmppServerHttp::acceptedEncoding(const QDjangoHttpRequest &request)
+{
+    bool deflate = false;
+    foreach (const QString &item, request.meta("HTTP_ACCEPT_ENCODING").split(',')) {
+        const QStringList bits = item.split(';');
+        const QString coding = bits.first().trimmed().toLower();
+        bool accepted = true;
+        for (int i = 1; i < bits.size(); ++i) {
+            const QString param = bits[i].trimmed();
+            if (param.startsWith("q=") && param.mid(2).toDouble() <= 0)
+                accepted = false;
+        }
+        if (!accepted)
+            continue;
+        if (coding == "gzip")
+            return "gzip";
+        else if (coding == "deflate")
+            deflate = true;
+    }
+    return deflate ? "deflate" : QByteArray();
+}
+
+QString XmppServerHttp::accessLog() const
+{
+    return d->accessLog;
+}
+
+void XmppServerHttp::setAccessLog(const QString &accessLog)
+{
+    d->accessLog = accessLog;
+}
+
+QStringList XmppServerHttp::accessLogSamplePaths() const
+{
+    return d->accessLogSamplePaths;
+}
+
+void XmppServerHttp::setAccessLogSamplePaths(const QStringList &paths)
+{
+    d->accessLogSamplePaths = paths;
+}
+
+int XmppServerHttp::accessLogSampleRate() const
+{
+    return d->accessLogSampleRate;
+}
+
+void XmppServerHttp::setAccessLogSampleRate(int rate)
+{
+    d->accessLogSampleRate = qMax(1, rate);
+}
+
 QString XmppServerHttp::host() const
 {
     return d->host;
@@ -88,6 +1184,26 @@ void XmppServerHttp::setPort(quint16 port)
     d->port = port;
 }
 
+int XmppServerHttp::staticCacheSize() const
+{
+    return d->staticCache.maxCost();
+}
+
+void XmppServerHttp::setStaticCacheSize(int size)
+{
+    d->staticCache.setMaxCost(size);
+}
+
+bool XmppServerHttp::staticGzip() const
+{
+    return d->staticGzip;
+}
+
+void XmppServerHttp::setStaticGzip(bool staticGzip)
+{
+    d->staticGzip = staticGzip;
+}
+
 QString XmppServerHttp::staticRoot() const
 {
     return d->staticRoot;
@@ -108,11 +1224,41 @@ void XmppServerHttp::setStaticUrl(const QString &staticUrl)
     d->staticUrl = staticUrl;
 }
 
+int XmppServerHttp::threads() const
+{
+    return d->threads;
+}
+
+void XmppServerHttp::setThreads(int threads)
+{
+    d->threads = threads;
+}
+
 bool XmppServerHttp::start()
 {
-    if (!d->httpServer->listen(QHostAddress(d->host), d->port))
+    bool check;
+    Q_UNUSED(check);
+
+#ifndef HAVE_QDJANGO_HTTP_PRIVATE
+    if (d->threads > 0) {
+        warning("HTTP worker threads need the QDjango private headers, serving HTTP from the main thread");
+        d->threads = 0;
+    }
+#endif
+
+    if (d->threads > 0) {
+        d->listener = new HttpListener(d);
+        if (!d->listener->listen(QHostAddress(d->host), d->port)) {
+            delete d->listener;
+            d->listener = 0;
+            return false;
+        }
+    } else if (!d->httpServer->listen(QHostAddress(d->host), d->port)) {
         return false;
+    }
 
+    // the threaded handlers are not locked, they must be in place before
+    // the workers start
     if (!d->staticRoot.isEmpty() && !d->staticUrl.isEmpty()) {
         QString rx(d->staticUrl);
         while (rx.startsWith('/'))
@@ -120,36 +1266,190 @@ bool XmppServerHttp::start()
         if (!rx.endsWith('/'))
             rx.append('/');
 
-        d->httpServer->urls()->set(QRegExp("^" + rx + "(.+)$"), this, "_q_serveStatic");
+        d->threadedUrls->set(QRegExp("^" + rx + "(.+)$"), this, "_q_serveStatic");
     }
+
+    if (!d->accessLog.isEmpty())
+        d->accessLogWriter = new AccessLogWriter(d->accessLog, this);
+
+    if (d->listener) {
+        for (int i = 0; i < d->threads; ++i) {
+            HttpWorker *worker = new HttpWorker(d);
+            if (d->accessLogWriter)
+                worker->setLogQueue(d->accessLogWriter->createQueue());
+
+            QThread *thread = new QThread;
+            worker->moveToThread(thread);
+            check = connect(thread, SIGNAL(finished()),
+                            worker, SLOT(deleteLater()));
+            Q_ASSERT(check);
+            thread->start();
+
+            d->workers << worker;
+            d->workerThreads << thread;
+        }
+    } else if (d->accessLogWriter) {
+        d->mainWorker->setLogQueue(d->accessLogWriter->createQueue());
+    }
+
+    if (d->accessLogWriter)
+        d->accessLogWriter->start();
+
     return true;
 }
 
 void XmppServerHttp::stop()
 {
     d->httpServer->close();
+    if (d->listener) {
+        delete d->listener;
+        d->listener = 0;
+
+        // drop the responses the workers are still waiting for
+        foreach (QDjangoHttpResponse *response, d->forwards.keys())
+            d->dropForward(response);
+
+        foreach (QThread *thread, d->workerThreads) {
+            thread->quit();
+            thread->wait();
+        }
+        qDeleteAll(d->workerThreads);
+        d->workerThreads.clear();
+        d->workers.clear();
+    }
+
+    if (d->accessLogWriter) {
+        d->accessLogWriter->stop();
+        delete d->accessLogWriter;
+        d->accessLogWriter = 0;
+        d->mainWorker->setLogQueue(0);
+    }
+}
+
+void XmppServerHttp::reload()
+{
+    if (d->accessLogWriter)
+        d->accessLogWriter->reopen();
 }
 
-void XmppServerHttp::_q_requestFinished(QDjangoHttpRequest *request, QDjangoHttpResponse *response)
+void XmppServerHttp::_q_forward(const QString &method, const QString &requestPath, const QVariantHash &meta, const QByteArray &body, const QString &path, QObject *worker, quint64 id)
 {
-    const QString referer = request->meta("HTTP_REFERER");
-    const QString userAgent = request->meta("HTTP_USER_AGENT");
+    bool check;
+    Q_UNUSED(check);
 
-    info(QString("HTTP request \"%1 %2 HTTP/%3\" %4 %5 \"%6\" \"%7\"").arg(
-        request->method(),
-        request->path(),
-        QLatin1String("1.1"),
-        QString::number(response->statusCode()),
-        QString::number(response->body().size()),
-        referer.isEmpty() ? QLatin1String("-") : referer,
-        userAgent.isEmpty() ? QLatin1String("-") : userAgent));
+    // the workers are being stopped
+    if (!d->listener)
+        return;
+
+    // QDjango only allows building requests through its test class
+    QDjangoHttpTestRequest *request = new QDjangoHttpTestRequest(method, requestPath);
+    foreach (const QString &key, meta.keys())
+        request->addMeta(key, meta.value(key).toString());
+    request->setBody(body);
+
+    ForwardedRequest forward;
+    forward.request = request;
+    forward.worker = worker;
+    forward.id = id;
+
+    QDjangoHttpResponse *response = d->urls->respond(*request, path);
+    d->forwards.insert(response, forward);
+    if (response->isReady()) {
+        d->completeForward(response);
+        return;
+    }
+
+    check = connect(response, SIGNAL(ready()),
+                    this, SLOT(_q_forwardReady()));
+    Q_ASSERT(check);
+
+    check = connect(response, SIGNAL(destroyed(QObject*)),
+                    this, SLOT(_q_forwardDestroyed(QObject*)));
+    Q_ASSERT(check);
+}
+
+void XmppServerHttp::_q_forwardCancelled(QObject *worker, quint64 id)
+{
+    foreach (QDjangoHttpResponse *response, d->forwards.keys()) {
+        const ForwardedRequest &forward = d->forwards[response];
+        if (forward.worker == worker && forward.id == id) {
+            d->dropForward(response);
+            break;
+        }
+    }
+}
+
+void XmppServerHttp::_q_forwardDestroyed(QObject *object)
+{
+    delete d->forwards.take(static_cast<QDjangoHttpResponse*>(object)).request;
+}
+
+void XmppServerHttp::_q_forwardReady()
+{
+    QDjangoHttpResponse *response = qobject_cast<QDjangoHttpResponse*>(sender());
+    if (response && d->forwards.contains(response))
+        d->completeForward(response);
+}
+
+void XmppServerHttp::_q_staticChanged(const QString &path)
+{
+    QMutexLocker locker(&d->staticMutex);
+
+    // drop the cached files affected by the change
+    QStringList keys;
+    if (QFileInfo(path).isDir()) {
+        // a file was added or removed, for instance a ".gz" sibling
+        foreach (const QString &key, d->staticCache.keys()) {
+            if (QFileInfo(key).path() == path)
+                keys << key;
+        }
+    } else {
+        keys << path;
+        if (path.endsWith(".gz"))
+            keys << path.left(path.size() - 3);
+    }
+    foreach (const QString &key, keys)
+        d->staticCache.remove(key);
+    setGauge("http.static.cache.bytes", d->staticCache.totalCost());
+}
+
+void XmppServerHttp::_q_staticUnwatch(const QString &filePath, const QStringList &paths)
+{
+    d->staticWatcher->removePaths(paths);
+
+    // stop watching the directory once none of its files are cached
+    const QString dirPath = QFileInfo(filePath).path();
+    if (!--d->staticDirectories[dirPath]) {
+        d->staticDirectories.remove(dirPath);
+        d->staticWatcher->removePath(dirPath);
+    }
+}
+
+void XmppServerHttp::_q_staticWatch(const QString &filePath, const QStringList &paths)
+{
+    d->staticWatcher->addPaths(paths);
+
+    // the directory is watched for files being added or removed, such
+    // as a ".gz" sibling
+    const QString dirPath = QFileInfo(filePath).path();
+    if (!d->staticDirectories[dirPath]++)
+        d->staticWatcher->addPath(dirPath);
+
+    // the file may have changed between the time it was read and the
+    // time the watch was added, in which case no change is reported
+    QMutexLocker locker(&d->staticMutex);
+    const CachedStaticAsset *asset = d->staticCache.object(filePath);
+    if (asset && !asset->isCurrent(filePath)) {
+        d->staticCache.remove(filePath);
+        setGauge("http.static.cache.bytes", d->staticCache.totalCost());
+    }
 }
 
 QDjangoHttpResponse *XmppServerHttp::_q_serveStatic(const QDjangoHttpRequest &request, const QString &path)
 {
     if (!path.contains("..")) {
         const QString filePath = QDir(d->staticRoot).filePath(path);
-        QDjangoHttpResponse *response = QDjangoHttpController::serveStatic(request, filePath);
+        QDjangoHttpResponse *response = d->serveFile(request, filePath);
         response->setHeader("Access-Control-Allow-Origin", "*");
         return response;
     }
@@ -20,46 +20,124 @@
 #ifndef XMPP_SERVER_HTTP_H
 #define XMPP_SERVER_HTTP_H
 
+#include <QElapsedTimer>
+#include <QHash>
+#include <QPointer>
+#include <QStringList>
+#include <QVariant>
+
 #include "QXmppServerExtension.h"
 
+class AccessLogQueue;
 class QDjangoHttpRequest;
 class QDjangoHttpResponse;
+class QDjangoHttpServer;
 class XmppServerHttpPrivate;
 
+/** A thread serving HTTP connections.
+ */
+class HttpWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    HttpWorker(XmppServerHttpPrivate *http, QObject *parent = 0);
+
+    int connectionCount() const;
+    void reserveConnection();
+    QDjangoHttpServer *server() const;
+    void setLogQueue(AccessLogQueue *queue);
+
+public slots:
+    void addConnection(qintptr descriptor);
+
+private slots:
+    void _q_complete(quint64 id, int statusCode, const QString &reasonPhrase, const QByteArray &body, const QVariantHash &headers);
+    void _q_connectionClosed();
+    QDjangoHttpResponse *_q_dispatch(const QDjangoHttpRequest &request, const QString &path);
+    void _q_requestFinished(QDjangoHttpRequest *request, QDjangoHttpResponse *response);
+
+private:
+    XmppServerHttpPrivate *m_http;
+    QAtomicInt m_connections;
+    QHash<quint64, QPointer<QDjangoHttpResponse> > m_forwards;
+    quint64 m_lastForward;
+    AccessLogQueue *m_logQueue;
+    qint64 m_logSampleCount;
+    QElapsedTimer m_clock;
+    QDjangoHttpServer *m_server;
+};
+
 class XmppServerHttp : public QXmppServerExtension
 {
     Q_OBJECT
     Q_CLASSINFO("ExtensionName", "http");
+    Q_PROPERTY(QString accessLog READ accessLog WRITE setAccessLog);
+    Q_PROPERTY(QStringList accessLogSamplePaths READ accessLogSamplePaths WRITE setAccessLogSamplePaths);
+    Q_PROPERTY(int accessLogSampleRate READ accessLogSampleRate WRITE setAccessLogSampleRate);
     Q_PROPERTY(QString host READ host WRITE setHost);
     Q_PROPERTY(quint16 port READ port WRITE setPort);
+    Q_PROPERTY(int staticCacheSize READ staticCacheSize WRITE setStaticCacheSize);
+    Q_PROPERTY(bool staticGzip READ staticGzip WRITE setStaticGzip);
     Q_PROPERTY(QString staticRoot READ staticRoot WRITE setStaticRoot);
     Q_PROPERTY(QString staticUrl READ staticUrl WRITE setStaticUrl);
+    Q_PROPERTY(int threads READ threads WRITE setThreads);
 
 public:
     XmppServerHttp();
     ~XmppServerHttp();
 
+    static QByteArray acceptedEncoding(const QDjangoHttpRequest &request);
+
+    QString accessLog() const;
+    void setAccessLog(const QString &accessLog);
+
+    QStringList accessLogSamplePaths() const;
+    void setAccessLogSamplePaths(const QStringList &paths);
+
+    int accessLogSampleRate() const;
+    void setAccessLogSampleRate(int rate);
+
     QString host() const;
     void setHost(const QString &host);
 
     quint16 port() const;
     void setPort(quint16 port);
 
+    int staticCacheSize() const;
+    void setStaticCacheSize(int size);
+
+    bool staticGzip() const;
+    void setStaticGzip(bool staticGzip);
+
     QString staticRoot() const;
     void setStaticRoot(const QString &staticRoot);
 
     QString staticUrl() const;
     void setStaticUrl(const QString &staticUrl);
 
+    int threads() const;
+    void setThreads(int threads);
+
     bool start();
     void stop();
 
+public slots:
+    void reload();
+
 private slots:
+    void _q_forward(const QString &method, const QString &requestPath, const QVariantHash &meta, const QByteArray &body, const QString &path, QObject *worker, quint64 id);
+    void _q_forwardCancelled(QObject *worker, quint64 id);
+    void _q_forwardDestroyed(QObject *object);
+    void _q_forwardReady();
     QDjangoHttpResponse *_q_serveStatic(const QDjangoHttpRequest &request, const QString &path);
-    void _q_requestFinished(QDjangoHttpRequest *request, QDjangoHttpResponse *response);
+    void _q_staticChanged(const QString &path);
+    void _q_staticUnwatch(const QString &filePath, const QStringList &paths);
+    void _q_staticWatch(const QString &filePath, const QStringList &paths);
 
 private:
     XmppServerHttpPrivate * const d;
+    friend class XmppServerHttpPrivate;
 };
 
 #endif
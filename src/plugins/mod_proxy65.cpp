@@ -22,8 +22,17 @@
 #include <QDomElement>
 #include <QHostInfo>
 #include <QSettings>
+#include <QSocketNotifier>
+#include <QThread>
 #include <QTimer>
 
+#ifdef Q_OS_LINUX
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
 #include "QXmppByteStreamIq.h"
 #include "QXmppConfiguration.h"
 #include "QXmppConstants.h"
@@ -61,10 +70,37 @@ static QString streamHash(const QString &sid, const QString &initiatorJid, const
 QTcpSocketPair::QTcpSocketPair(const QString &hash, QObject *parent)
     : QXmppLoggable(parent),
     key(hash),
+    activated(false),
+    pipeSize(0),
     transfer(0),
     target(0),
-    source(0)
+    source(0),
+    spliceIn(-1),
+    spliceOut(-1),
+    spliced(0),
+    readNotifier(0),
+    writeNotifier(0),
+    hangupNotifier(0)
+{
+    splicePipe[0] = -1;
+    splicePipe[1] = -1;
+}
+
+QTcpSocketPair::~QTcpSocketPair()
 {
+#ifdef Q_OS_LINUX
+    delete readNotifier;
+    delete writeNotifier;
+    delete hangupNotifier;
+    if (spliceIn >= 0)
+        ::close(spliceIn);
+    if (spliceOut >= 0)
+        ::close(spliceOut);
+    if (splicePipe[0] >= 0)
+        ::close(splicePipe[0]);
+    if (splicePipe[1] >= 0)
+        ::close(splicePipe[1]);
+#endif
 }
 
 bool QTcpSocketPair::activate()
@@ -74,6 +110,9 @@ bool QTcpSocketPair::activate()
         return false;
     }
     time.start();
+    if (pipeSize > 0 && startSplice())
+        return true;
+
     connect(target, SIGNAL(bytesWritten(qint64)), this, SLOT(sendData()));
     connect(source, SIGNAL(readyRead()), this, SLOT(sendData()));
     return true;
@@ -116,14 +155,21 @@ void QTcpSocketPair::disconnected()
     if (!socket)
         return;
 
+    // the transfer count must not change once we are finished, as it
+    // may be read from another thread
     if (target == socket)
     {
         debug("Closed target connection for " + key);
+        if (source)
+            source->disconnect(this);
         emit finished();
     } else if (source == socket) {
         debug("Closed source connection for " + key);
-        if (!target || !target->isOpen())
+        if (!target || !target->isOpen()) {
+            if (target)
+                target->disconnect(this);
             emit finished();
+        }
     }
 }
 
@@ -156,6 +202,142 @@ void QTcpSocketPair::sendData()
     }
 }
 
+/// Stops relaying data and reports the pair as finished.
+///
+
+void QTcpSocketPair::finishSplice()
+{
+    readNotifier->setEnabled(false);
+    writeNotifier->setEnabled(false);
+    hangupNotifier->setEnabled(false);
+    emit finished();
+}
+
+/// Moves the data path to a relay which uses splice() through a pipe, so
+/// that the data is not copied to user space.
+///
+/// Returns false if this is not possible, in which case the data is
+/// relayed through the QTcpSocket objects.
+
+bool QTcpSocketPair::startSplice()
+{
+#ifdef Q_OS_LINUX
+    bool check;
+    Q_UNUSED(check);
+
+    // data which Qt has not written yet would be lost
+    if (source->bytesToWrite() || target->bytesToWrite())
+        return false;
+
+    if (::pipe2(splicePipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        warning("Could not create pipe for " + key);
+        return false;
+    }
+    ::fcntl(splicePipe[1], F_SETPIPE_SZ, pipeSize);
+
+    spliceIn = ::fcntl(source->socketDescriptor(), F_DUPFD_CLOEXEC, 0);
+    spliceOut = ::fcntl(target->socketDescriptor(), F_DUPFD_CLOEXEC, 0);
+    if (spliceIn < 0 || spliceOut < 0) {
+        warning("Could not duplicate sockets for " + key);
+        return false;
+    }
+
+    // take the sockets away from Qt, keeping the data it already read
+    splicePending = source->readAll();
+    source->disconnect(this);
+    target->disconnect(this);
+    source->abort();
+    target->abort();
+
+    readNotifier = new QSocketNotifier(spliceIn, QSocketNotifier::Read, this);
+    check = connect(readNotifier, SIGNAL(activated(int)),
+                    this, SLOT(spliceData()));
+    Q_ASSERT(check);
+
+    writeNotifier = new QSocketNotifier(spliceOut, QSocketNotifier::Write, this);
+    writeNotifier->setEnabled(false);
+    check = connect(writeNotifier, SIGNAL(activated(int)),
+                    this, SLOT(spliceData()));
+    Q_ASSERT(check);
+
+    // the target is not expected to send anything, but it may hang up
+    hangupNotifier = new QSocketNotifier(spliceOut, QSocketNotifier::Read, this);
+    check = connect(hangupNotifier, SIGNAL(activated(int)),
+                    this, SLOT(spliceHangup()));
+    Q_ASSERT(check);
+
+    spliceData();
+    return true;
+#else
+    return false;
+#endif
+}
+
+void QTcpSocketPair::spliceData()
+{
+#ifdef Q_OS_LINUX
+    // send the data Qt had already read
+    while (!splicePending.isEmpty()) {
+        const ssize_t length = ::send(spliceOut, splicePending.constData(), splicePending.size(), MSG_NOSIGNAL);
+        if (length < 0 && errno == EAGAIN) {
+            readNotifier->setEnabled(false);
+            writeNotifier->setEnabled(true);
+            return;
+        } else if (length <= 0) {
+            finishSplice();
+            return;
+        }
+        splicePending.remove(0, length);
+        transfer += length;
+    }
+
+    for (;;) {
+        // empty the pipe into the target
+        while (spliced > 0) {
+            const ssize_t length = ::splice(splicePipe[0], 0, spliceOut, 0, spliced, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (length < 0 && errno == EAGAIN) {
+                // don't read more than the target can take
+                readNotifier->setEnabled(false);
+                writeNotifier->setEnabled(true);
+                return;
+            } else if (length <= 0) {
+                debug("Closed target connection for " + key);
+                finishSplice();
+                return;
+            }
+            spliced -= length;
+        }
+        writeNotifier->setEnabled(false);
+
+        // fill the pipe from the source
+        const ssize_t length = ::splice(spliceIn, 0, splicePipe[1], 0, pipeSize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (length < 0 && errno == EAGAIN) {
+            readNotifier->setEnabled(true);
+            return;
+        } else if (length <= 0) {
+            // all the data was sent
+            debug("Closed source connection for " + key);
+            finishSplice();
+            return;
+        }
+        spliced += length;
+        transfer += length;
+    }
+#endif
+}
+
+void QTcpSocketPair::spliceHangup()
+{
+#ifdef Q_OS_LINUX
+    char buffer[512];
+    const ssize_t length = ::recv(spliceOut, buffer, sizeof(buffer), 0);
+    if (length == 0 || (length < 0 && errno != EAGAIN)) {
+        debug("Closed target connection for " + key);
+        finishSplice();
+    }
+#endif
+}
+
 class XmppServerProxy65Private
 {
 public:
@@ -164,11 +346,17 @@ public:
     QString jid;
     QHostAddress hostAddress;
     QString hostName;
+    int pipeSize;
     quint16 port;
+    int threads;
 
     // state
     QHash<QString, QTcpSocketPair*> pairs;
     QXmppSocksServer *server;
+
+    // relay threads, with the number of transfers each one serves
+    QList<QThread*> relayThreads;
+    QHash<QThread*, int> relayLoad;
 };
 
 XmppServerProxy65::XmppServerProxy65()
@@ -177,7 +365,12 @@ XmppServerProxy65::XmppServerProxy65()
     bool check;
     Q_UNUSED(check);
 
+    // needed to log from the relay threads
+    qRegisterMetaType<QXmppLogger::MessageType>("QXmppLogger::MessageType");
+
+    d->pipeSize = 65536;
     d->port = 7777;
+    d->threads = 0;
     d->server = new QXmppSocksServer(this);
 
     check = connect(d->server, SIGNAL(newConnection(QTcpSocket*,QString,quint16)),
@@ -245,6 +438,27 @@ void XmppServerProxy65::setHost(const QString &host)
     d->hostName = host;
 }
 
+/// Returns the size of the pipe used to relay each transfer.
+///
+
+int XmppServerProxy65::pipeSize() const
+{
+    return d->pipeSize;
+}
+
+/// Sets the size of the pipe used to relay each transfer.
+///
+/// On Linux, activated transfers are relayed with splice() through a
+/// pipe of this size, set it to 0 to relay them through QTcpSocket.
+/// If not defined, defaults to 65536.
+///
+/// \param pipeSize
+
+void XmppServerProxy65::setPipeSize(int pipeSize)
+{
+    d->pipeSize = pipeSize;
+}
+
 /// Returns the port on which to listen for SOCKS5 connections.
 ///
 
@@ -264,6 +478,26 @@ void XmppServerProxy65::setPort(quint16 port)
     d->port = port;
 }
 
+/// Returns the number of threads which relay the transfers.
+///
+
+int XmppServerProxy65::threads() const
+{
+    return d->threads;
+}
+
+/// Sets the number of threads which relay the transfers.
+///
+/// If not defined, defaults to 0 and transfers are relayed by the main
+/// thread.
+///
+/// \param threads
+
+void XmppServerProxy65::setThreads(int threads)
+{
+    d->threads = threads;
+}
+
 QStringList XmppServerProxy65::discoveryItems() const
 {
     return QStringList() << d->jid;
@@ -352,12 +586,40 @@ bool XmppServerProxy65::handleStanza(const QDomElement &element)
             responseIq.setFrom(bsIq.to());
             responseIq.setId(bsIq.id());
 
-            if (pair &&
+            if (pair && pair->activated)
+            {
+                // the pair may already live on a relay thread
+                warning(QString("Connection %1 was already activated by %2").arg(hash, bsIq.from()));
+                responseIq.setType(QXmppIq::Error);
+                responseIq.setError(QXmppStanza::Error(QXmppStanza::Error::Cancel, QXmppStanza::Error::NotAllowed));
+            }
+            else if (pair &&
                 d->allowedDomains.contains(QXmppUtils::jidToDomain(bsIq.from())))
             {
                 if (pair->activate()) {
                     info(QString("Activated connection %1 by %2").arg(hash, bsIq.from()));
                     responseIq.setType(QXmppIq::Result);
+                    pair->activated = true;
+
+                    // hand the transfer to the least loaded relay thread
+                    QThread *relayThread = 0;
+                    foreach (QThread *candidate, d->relayThreads) {
+                        if (!relayThread || d->relayLoad.value(candidate) < d->relayLoad.value(relayThread))
+                            relayThread = candidate;
+                    }
+                    if (relayThread) {
+                        bool check;
+                        Q_UNUSED(check);
+
+                        // objects with a parent cannot change threads
+                        pair->setParent(0);
+                        check = connect(pair, SIGNAL(logMessage(QXmppLogger::MessageType,QString)),
+                                        this, SIGNAL(logMessage(QXmppLogger::MessageType,QString)));
+                        Q_ASSERT(check);
+
+                        pair->moveToThread(relayThread);
+                        d->relayLoad[relayThread]++;
+                    }
                 } else {
                     warning(QString("Failed to activate connection %1 by %2").arg(hash, bsIq.from()));
                     responseIq.setType(QXmppIq::Error);
@@ -396,6 +658,14 @@ bool XmppServerProxy65::start()
     if (!d->server->listen(d->port))
         return false;
 
+    // start relay threads
+    for (int i = 0; i < d->threads; ++i) {
+        QThread *thread = new QThread;
+        thread->start();
+        d->relayThreads << thread;
+        d->relayLoad.insert(thread, 0);
+    }
+
     return true;
 }
 
@@ -404,10 +674,27 @@ void XmppServerProxy65::stop()
     // refuse incoming connections
     d->server->close();
 
-    // close socket pairs
-    foreach (QTcpSocketPair *pair, d->pairs)
-        delete pair;
+    // close socket pairs, those on relay threads are deleted as the
+    // threads finish
+    foreach (QTcpSocketPair *pair, d->pairs) {
+        if (pair->thread() == thread())
+            delete pair;
+        else
+            pair->deleteLater();
+    }
     d->pairs.clear();
+
+    // stop relay threads
+    foreach (QThread *thread, d->relayThreads) {
+        thread->quit();
+        thread->wait();
+    }
+    qDeleteAll(d->relayThreads);
+    d->relayThreads.clear();
+    d->relayLoad.clear();
+
+    // discard the notifications from the deleted pairs
+    QCoreApplication::removePostedEvents(this, QEvent::MetaCall);
 }
 
 void XmppServerProxy65::slotSocketConnected(QTcpSocket *socket, const QString &hostName, quint16 port)
@@ -415,12 +702,20 @@ void XmppServerProxy65::slotSocketConnected(QTcpSocket *socket, const QString &h
     Q_UNUSED(port);
 
     QTcpSocketPair *pair = d->pairs.value(hostName);
-    if (!pair)
+    if (pair && pair->activated)
+    {
+        // the transfer was already activated
+        warning("Unexpected connection for " + hostName);
+        socket->deleteLater();
+        return;
+    }
+    else if (!pair)
     {
         bool check;
         Q_UNUSED(check);
 
         pair = new QTcpSocketPair(hostName, this);
+        pair->pipeSize = d->pipeSize;
         check = connect(pair, SIGNAL(finished()),
                         this, SLOT(slotPairFinished()));
         Q_ASSERT(check);
@@ -440,6 +735,8 @@ void XmppServerProxy65::slotPairFinished()
     // update totals
     updateCounter("proxy65.bytes", pair->transfer);
     updateCounter("proxy65.transfers");
+    if (d->relayLoad.contains(pair->thread()))
+        d->relayLoad[pair->thread()]--;
 
     // remove socket pair
     d->pairs.remove(pair->key);
@@ -25,6 +25,7 @@
 
 #include "QXmppServerExtension.h"
 
+class QSocketNotifier;
 class QTcpSocket;
 
 class QTcpSocketPair : public QXmppLoggable
@@ -33,11 +34,14 @@ class QTcpSocketPair : public QXmppLoggable
 
 public:
     QTcpSocketPair(const QString &hash, QObject *parent = 0);
+    ~QTcpSocketPair();
 
     bool activate();
     void addSocket(QTcpSocket *socket);
 
     QString key;
+    bool activated;
+    int pipeSize;
     QTime time;
     qint64 transfer;
 
@@ -47,10 +51,25 @@ signals:
 private slots:
     void disconnected();
     void sendData();
+    void spliceData();
+    void spliceHangup();
 
 private:
+    void finishSplice();
+    bool startSplice();
+
     QTcpSocket *target;
     QTcpSocket *source;
+
+    // splice() relay
+    int spliceIn;
+    int spliceOut;
+    int splicePipe[2];
+    qint64 spliced;
+    QByteArray splicePending;
+    QSocketNotifier *readNotifier;
+    QSocketNotifier *writeNotifier;
+    QSocketNotifier *hangupNotifier;
 };
 
 class XmppServerProxy65Private;
@@ -65,7 +84,9 @@ class XmppServerProxy65 : public QXmppServerExtension
     Q_PROPERTY(QStringList allowedDomains READ allowedDomains WRITE setAllowedDomains);
     Q_PROPERTY(QString jid READ jid WRITE setJid);
     Q_PROPERTY(QString host READ host WRITE setHost);
+    Q_PROPERTY(int pipeSize READ pipeSize WRITE setPipeSize);
     Q_PROPERTY(quint16 port READ port WRITE setPort);
+    Q_PROPERTY(int threads READ threads WRITE setThreads);
 
 public:
     XmppServerProxy65();
@@ -80,9 +101,15 @@ public:
     QString host() const;
     void setHost(const QString &host);
 
+    int pipeSize() const;
+    void setPipeSize(int pipeSize);
+
     quint16 port() const;
     void setPort(quint16 port);
 
+    int threads() const;
+    void setThreads(int threads);
+
     /// \cond
     QStringList discoveryItems() const;
     bool handleStanza(const QDomElement &element);
@@ -0,0 +1,159 @@
+/*
+ * xmpp-share-server
+ * Copyright (C) 2010-2013 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QSet>
+#include <QStringList>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+#include "QXmppIncomingWebSocket.h"
+#include "QXmppServer.h"
+#include "QXmppServerPlugin.h"
+
+#include "mod_websocket.h"
+
+class XmppServerWebSocketPrivate
+{
+public:
+    QTcpServer *tcpServer;
+    QSet<QXmppIncomingWebSocket*> streams;
+
+    // config
+    QString host;
+    quint16 port;
+};
+
+XmppServerWebSocket::XmppServerWebSocket()
+    : d(new XmppServerWebSocketPrivate)
+{
+    bool check;
+    Q_UNUSED(check);
+
+    d->host = "0.0.0.0";
+    d->port = 5290;
+    d->tcpServer = new QTcpServer(this);
+
+    check = connect(d->tcpServer, SIGNAL(newConnection()),
+                    this, SLOT(_q_newConnection()));
+    Q_ASSERT(check);
+}
+
+XmppServerWebSocket::~XmppServerWebSocket()
+{
+    delete d;
+}
+
+/// Returns the address on which to listen for WebSocket connections.
+///
+
+QString XmppServerWebSocket::host() const
+{
+    return d->host;
+}
+
+/// Sets the address on which to listen for WebSocket connections.
+///
+/// \param host
+
+void XmppServerWebSocket::setHost(const QString &host)
+{
+    d->host = host;
+}
+
+/// Returns the port on which to listen for WebSocket connections.
+///
+
+quint16 XmppServerWebSocket::port() const
+{
+    return d->port;
+}
+
+/// Sets the port on which to listen for WebSocket connections.
+///
+/// \param port
+
+void XmppServerWebSocket::setPort(quint16 port)
+{
+    d->port = port;
+}
+
+bool XmppServerWebSocket::start()
+{
+    if (!d->tcpServer->listen(QHostAddress(d->host), d->port)) {
+        warning(QString("Could not listen for WebSocket connections on %1:%2").arg(d->host, QString::number(d->port)));
+        return false;
+    }
+    return true;
+}
+
+void XmppServerWebSocket::stop()
+{
+    d->tcpServer->close();
+    foreach (QXmppIncomingWebSocket *stream, d->streams)
+        stream->disconnectFromHost();
+}
+
+void XmppServerWebSocket::_q_newConnection()
+{
+    bool check;
+    Q_UNUSED(check);
+
+    QTcpSocket *socket;
+    while ((socket = d->tcpServer->nextPendingConnection()) != 0) {
+        QXmppIncomingWebSocket *stream = new QXmppIncomingWebSocket(socket, server()->domain(), server());
+        check = connect(stream, SIGNAL(disconnected()),
+                        this, SLOT(_q_streamDisconnected()));
+        Q_ASSERT(check);
+
+        d->streams.insert(stream);
+        server()->addIncomingClient(stream);
+    }
+    setGauge("websocket.sessions", d->streams.size());
+}
+
+void XmppServerWebSocket::_q_streamDisconnected()
+{
+    QXmppIncomingWebSocket *stream = qobject_cast<QXmppIncomingWebSocket*>(sender());
+    if (!stream)
+        return;
+
+    d->streams.remove(stream);
+    setGauge("websocket.sessions", d->streams.size());
+}
+
+// PLUGIN
+
+class XmppServerWebSocketPlugin : public QXmppServerPlugin
+{
+public:
+    QXmppServerExtension *create(const QString &key)
+    {
+        if (key == QLatin1String("websocket"))
+            return new XmppServerWebSocket;
+        else
+            return 0;
+    };
+
+    QStringList keys() const
+    {
+        return QStringList() << QLatin1String("websocket");
+    };
+};
+
+Q_EXPORT_PLUGIN2(websocket, XmppServerWebSocketPlugin)
@@ -19,6 +19,8 @@
 
 #include <cstdlib>
 #include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <QCoreApplication>
 #include <QDebug>
@@ -26,6 +28,7 @@
 #include <QFileInfo>
 #include <QPluginLoader>
 #include <QSettings>
+#include <QSocketNotifier>
 #include <QStringList>
 #include <QtPlugin>
 #include <QUdpSocket>
@@ -48,9 +51,13 @@
 
 static XmppLogger *logger = 0;
 static QSettings *settings = 0;
+static QXmppServer *xmppServer = 0;
 
 static QTemporaryFile tmpFile;
 
+// pipe from the signal handler to the event loop
+static int signalFds[2] = { -1, -1 };
+
 static bool openDatabase(const QSettings &settings)
 {
     const QString databaseDriver = settings.value("database/driver", "QSQLITE").toString();
@@ -149,17 +156,72 @@ static void log_handler(QtMsgType type, const QMessageLogContext &context, const
 
 static void signal_handler(int sig)
 {
-    static int aborted = 0;
-    if (sig == SIGHUP) {
-        logger->readSettings();
-        logger->log(QXmppLogger::InformationMessage, QString("Reloaded version %1").arg(qApp->applicationVersion()));
-    } else if (sig == SIGINT || sig == SIGTERM) {
-        if (aborted)
-            exit(EXIT_FAILURE);
+    static volatile sig_atomic_t aborted = 0;
 
-        qApp->quit();
+    // a second interruption exits even if the event loop is stuck
+    if (sig == SIGINT || sig == SIGTERM) {
+        if (aborted)
+            _exit(EXIT_FAILURE);
         aborted = 1;
     }
+
+    // only async-signal-safe calls are allowed here, the signal is
+    // handled by SignalNotifier from the event loop
+    const char c = sig;
+    const ssize_t written = ::write(signalFds[1], &c, 1);
+    Q_UNUSED(written);
+}
+
+SignalNotifier::SignalNotifier(QObject *parent)
+    : QObject(parent)
+    , m_notifier(0)
+{
+    bool check;
+    Q_UNUSED(check);
+
+    if (::pipe(signalFds) < 0) {
+        qWarning("Could not create signal pipe");
+        return;
+    }
+    for (int i = 0; i < 2; ++i)
+        ::fcntl(signalFds[i], F_SETFL, ::fcntl(signalFds[i], F_GETFL) | O_NONBLOCK);
+
+    m_notifier = new QSocketNotifier(signalFds[0], QSocketNotifier::Read, this);
+    check = connect(m_notifier, SIGNAL(activated(int)),
+                    this, SLOT(_q_activated()));
+    Q_ASSERT(check);
+}
+
+SignalNotifier::~SignalNotifier()
+{
+    delete m_notifier;
+    if (signalFds[0] >= 0) {
+        ::close(signalFds[0]);
+        ::close(signalFds[1]);
+        signalFds[0] = signalFds[1] = -1;
+    }
+}
+
+void SignalNotifier::_q_activated()
+{
+    char c;
+    while (::read(signalFds[0], &c, 1) == 1) {
+        const int sig = c;
+        if (sig == SIGHUP) {
+            logger->readSettings();
+
+            // let extensions reload their data
+            if (xmppServer) {
+                foreach (QXmppServerExtension *extension, xmppServer->extensions()) {
+                    if (extension->metaObject()->indexOfMethod("reload()") >= 0)
+                        QMetaObject::invokeMethod(extension, "reload");
+                }
+            }
+            logger->log(QXmppLogger::InformationMessage, QString("Reloaded version %1").arg(qApp->applicationVersion()));
+        } else if (sig == SIGINT || sig == SIGTERM) {
+            qApp->quit();
+        }
+    }
 }
 
 class PluginManager;
@@ -368,10 +430,15 @@ int main(int argc, char *argv[])
     app.setApplicationVersion(SERVER_VERSION);
 
     /* Install signal handler */
+    SignalNotifier signalNotifier;
     signal(SIGHUP, signal_handler);
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
+    /* Writes to a closed connection must fail with EPIPE rather than
+     * kill the server, splice() has no flag to prevent the signal */
+    signal(SIGPIPE, SIG_IGN);
+
     /* Read settings */
     if (!QFileInfo(settingsPath).isReadable())
     {
@@ -441,7 +508,9 @@ int main(int argc, char *argv[])
     }
 
     /* Run application */
+    xmppServer = &server;
     int ret = app.exec();
+    xmppServer = 0;
     logger->log(QXmppLogger::InformationMessage, "Exiting");
     delete logger;
     return ret;
@@ -21,8 +21,29 @@
 
 #include "QXmppLogger.h"
 
+class QSocketNotifier;
 class QUdpSocket;
 
+/** Handles Unix signals from the event loop.
+ *
+ *  The signal handler only writes the signal number to a pipe, whose
+ *  other end is watched by this object.
+ */
+class SignalNotifier : public QObject
+{
+    Q_OBJECT
+
+public:
+    SignalNotifier(QObject *parent = 0);
+    ~SignalNotifier();
+
+private slots:
+    void _q_activated();
+
+private:
+    QSocketNotifier *m_notifier;
+};
+
 class XmppLogger : public QXmppLogger
 {
     Q_OBJECT